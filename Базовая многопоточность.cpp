@@ -4,6 +4,7 @@
 #include <vector>
 #include <iostream>
 #include <future>
+#include <thread>
 #include <map>
 #include <functional>
 #include <sstream>
@@ -16,6 +17,34 @@
 #include <random>
 #include <memory>
 #include <algorithm>
+#include <unordered_map>
+#include <string_view>
+#include <cstdint>
+#include <cctype>
+#include <condition_variable>
+#include <atomic>
+#include <optional>
+#include <fstream>
+#include <filesystem>
+#include <iterator>
+#include <array>
+#include <cstring>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define KEYWORDS_USE_SSE2
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
@@ -61,24 +90,15 @@ vector<string> FetchMore(size_t size, istream& input){
     return result;
 }
 
-Stats ExploreKeyWords(const set<string>& key_words, istream& input) {
-    Stats result;
-    const size_t PAGE_SIZE = 10000;
-    vector<future<Stats>> interm_results;
-
-    vector<string> strings = FetchMore(PAGE_SIZE, input);
-    while (strings.size() > 0) {
-        interm_results.push_back(async(
-            ExploreLinesVector, key_words, move(strings)));
-        strings = FetchMore(PAGE_SIZE, input);
-    }
-
-    for (auto& f: interm_results) {
-        result += f.get();
-    }
-    return result;
+// Worker count of every page pipeline unless the caller asks for another
+size_t DefaultWorkerCount() {
+    return max(1u, thread::hardware_concurrency());
 }
 
+// Counts on the shared page pool (see CountKeyWords), with one counts vector per
+// worker merged once at the end
+Stats ExploreKeyWords(const set<string>& key_words, istream& input);
+
 void TestBasic() {
     const set<string> key_words = { "yangle", "rocks", "sucks", "all" };
 
@@ -121,6 +141,4764 @@ void TestLong() {
     ASSERT_EQUAL(stats.word_frequences, expected);
 }
 
+// The five-line review fixture of TestBasic repeated `operations` times
+string MakeYangleText(int operations) {
+    string text;
+    for (int i = 0; i < operations; ++i) {
+        text += "this new yangle service really rocks\n";
+        text += "It sucks when yangle isn't available\n";
+        text += "10 reasons why yangle is the best IT company\n";
+        text += "yangle rocks others suck\n";
+        text += "Goondex really sucks, but yangle rocks. Use yangle\n";
+    }
+    return text;
+}
+
+template <typename Callback>
+void ForEachWord(string_view line, Callback callback) {
+    auto is_space = [](char c) { return isspace(static_cast<unsigned char>(c)) != 0; };
+    size_t pos = 0;
+    while (true) {
+        while (pos < line.size() && is_space(line[pos])) ++pos;
+        if (pos == line.size()) break;
+        size_t end = pos;
+        while (end < line.size() && !is_space(line[end])) ++end;
+        callback(line.substr(pos, end - pos));
+        pos = end;
+    }
+}
+
+struct KeyWordPattern {
+    enum class Kind { Glob, Regex };
+
+    Kind kind;
+    string text;
+};
+
+class PatternDfa {
+public:
+    PatternDfa() = default;
+
+    explicit PatternDfa(const vector<KeyWordPattern>& patterns) {
+        if (patterns.empty()) return;
+        Nfa nfa;
+        size_t start = nfa.NewState();
+        for (size_t id = 0; id < patterns.size(); ++id) {
+            const auto& pattern = patterns[id];
+            nfa.limit = nfa.states.size() + MAX_PATTERN_STATES;
+            auto fragment = pattern.kind == KeyWordPattern::Kind::Glob
+                ? ParseGlob(nfa, pattern.text)
+                : RegexParser{ nfa, pattern.text }.Parse();
+            nfa.states[start].epsilon.push_back(fragment.start);
+            nfa.states[fragment.end].accept = id;
+        }
+        BuildByteClasses(nfa);
+        BuildSubsets(nfa, start);
+        Minimize();
+    }
+
+    bool Empty() const {
+        return accepts_.empty();
+    }
+
+    size_t StateCount() const {
+        return accepts_.size();
+    }
+
+    template <typename Callback>
+    void ForEachMatch(string_view token, Callback callback) const {
+        if (Empty()) return;
+        uint32_t state = start_;
+        for (char c : token) {
+            state = transitions_[state * class_count_ + byte_class_[static_cast<unsigned char>(c)]];
+            if (state == dead_) return;
+        }
+        for (size_t id : accepts_[state]) {
+            callback(id);
+        }
+    }
+private:
+    static constexpr size_t NONE = static_cast<size_t>(-1);
+    // NFA states one pattern may add; {m,n} makes nested copies, so short patterns
+    // such as "((a{1000}){1000}){1000}" would otherwise ask for billions
+    static constexpr size_t MAX_PATTERN_STATES = 100000;
+
+    struct Nfa {
+        struct State {
+            vector<bool> chars;
+            size_t next = NONE;
+            vector<size_t> epsilon;
+            size_t accept = NONE;
+        };
+        vector<State> states;
+        size_t limit = NONE;
+
+        size_t NewState() {
+            if (states.size() >= limit) {
+                throw invalid_argument("pattern needs more than " + to_string(MAX_PATTERN_STATES) + " NFA states");
+            }
+            states.emplace_back();
+            return states.size() - 1;
+        }
+    };
+
+    struct Fragment {
+        size_t start;
+        size_t end;
+    };
+
+    static Fragment CharSet(Nfa& nfa, vector<bool> chars) {
+        size_t start = nfa.NewState();
+        size_t end = nfa.NewState();
+        nfa.states[start].chars = move(chars);
+        nfa.states[start].next = end;
+        return { start, end };
+    }
+
+    static Fragment AnyChar(Nfa& nfa) {
+        return CharSet(nfa, vector<bool>(256, true));
+    }
+
+    static Fragment Literal(Nfa& nfa, char c) {
+        vector<bool> chars(256);
+        chars[static_cast<unsigned char>(c)] = true;
+        return CharSet(nfa, move(chars));
+    }
+
+    static Fragment Empty(Nfa& nfa) {
+        size_t state = nfa.NewState();
+        return { state, state };
+    }
+
+    static Fragment Concat(Nfa& nfa, Fragment lhs, Fragment rhs) {
+        nfa.states[lhs.end].epsilon.push_back(rhs.start);
+        return { lhs.start, rhs.end };
+    }
+
+    static Fragment Alternate(Nfa& nfa, Fragment lhs, Fragment rhs) {
+        size_t start = nfa.NewState();
+        size_t end = nfa.NewState();
+        nfa.states[start].epsilon = { lhs.start, rhs.start };
+        nfa.states[lhs.end].epsilon.push_back(end);
+        nfa.states[rhs.end].epsilon.push_back(end);
+        return { start, end };
+    }
+
+    static Fragment Repeat(Nfa& nfa, Fragment inner, bool allow_empty, bool allow_many) {
+        size_t start = nfa.NewState();
+        size_t end = nfa.NewState();
+        nfa.states[start].epsilon.push_back(inner.start);
+        if (allow_empty) nfa.states[start].epsilon.push_back(end);
+        if (allow_many) nfa.states[inner.end].epsilon.push_back(inner.start);
+        nfa.states[inner.end].epsilon.push_back(end);
+        return { start, end };
+    }
+
+    // \d, \w, \s and their upper-case negations over ASCII; nullopt for any other escape
+    static optional<vector<bool>> ShorthandClass(char c) {
+        const char lower = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+        if (lower != 'd' && lower != 'w' && lower != 's') return nullopt;
+        vector<bool> chars(256);
+        for (int b = 0; b < 128; ++b) {
+            chars[b] = lower == 'd' ? isdigit(b) != 0
+                : lower == 'w' ? isalnum(b) != 0 || b == '_'
+                : isspace(b) != 0;
+        }
+        if (c != lower) chars.flip();
+        return chars;
+    }
+
+    // Parses a bracket expression body; pos points right after '['. Regex classes
+    // also take shorthand escapes and reject other letter or digit escapes; only
+    // globs accept '!' for negation.
+    static vector<bool> ParseClass(string_view text, size_t& pos, bool regex = false) {
+        vector<bool> chars(256);
+        bool negate = pos < text.size() && (text[pos] == '^' || (!regex && text[pos] == '!'));
+        if (negate) ++pos;
+        bool first = true;
+        while (pos < text.size() && (text[pos] != ']' || first)) {
+            first = false;
+            if (regex && text[pos] == '\\' && pos + 1 < text.size()) {
+                if (auto shorthand = ShorthandClass(text[pos + 1])) {
+                    for (size_t c = 0; c < 256; ++c) {
+                        if ((*shorthand)[c]) chars[c] = true;
+                    }
+                    pos += 2;
+                    continue;
+                }
+                if (isalnum(static_cast<unsigned char>(text[pos + 1]))) {
+                    throw invalid_argument("unsupported escape in pattern " + string(text));
+                }
+            }
+            unsigned char from = text[pos] == '\\' && pos + 1 < text.size() ? text[++pos] : text[pos];
+            unsigned char to = from;
+            if (pos + 2 < text.size() && text[pos + 1] == '-' && text[pos + 2] != ']') {
+                to = text[pos + 2];
+                pos += 2;
+            }
+            if (from > to) {
+                throw invalid_argument("bad range in pattern " + string(text));
+            }
+            for (unsigned c = from; c <= to; ++c) {
+                chars[c] = true;
+            }
+            ++pos;
+        }
+        if (pos == text.size()) {
+            throw invalid_argument("unterminated [ in pattern " + string(text));
+        }
+        ++pos;
+        if (negate) chars.flip();
+        return chars;
+    }
+
+    static Fragment ParseGlob(Nfa& nfa, string_view text) {
+        Fragment result = Empty(nfa);
+        for (size_t pos = 0; pos < text.size();) {
+            Fragment next;
+            char c = text[pos++];
+            if (c == '*') {
+                next = Repeat(nfa, AnyChar(nfa), true, true);
+            } else if (c == '?') {
+                next = AnyChar(nfa);
+            } else if (c == '[') {
+                next = CharSet(nfa, ParseClass(text, pos));
+            } else if (c == '\\' && pos < text.size()) {
+                next = Literal(nfa, text[pos++]);
+            } else {
+                next = Literal(nfa, c);
+            }
+            result = Concat(nfa, result, next);
+        }
+        return result;
+    }
+
+    struct RegexParser {
+        Nfa& nfa;
+        string_view text;
+        size_t pos = 0;
+
+        Fragment Parse() {
+            Fragment result = ParseAlternation();
+            if (pos != text.size()) {
+                throw invalid_argument("unbalanced ) in pattern " + string(text));
+            }
+            return result;
+        }
+
+        Fragment ParseAlternation() {
+            Fragment result = ParseConcatenation();
+            while (pos < text.size() && text[pos] == '|') {
+                ++pos;
+                result = Alternate(nfa, result, ParseConcatenation());
+            }
+            return result;
+        }
+
+        Fragment ParseConcatenation() {
+            Fragment result = PatternDfa::Empty(nfa);
+            while (pos < text.size() && text[pos] != '|' && text[pos] != ')') {
+                result = Concat(nfa, result, ParseRepetition());
+            }
+            return result;
+        }
+
+        Fragment ParseRepetition() {
+            const size_t begin = pos;
+            const size_t first_state = nfa.states.size();
+            Fragment result = ParseAtom();
+            while (pos < text.size() && (text[pos] == '*' || text[pos] == '+' || text[pos] == '?' || text[pos] == '{')) {
+                if (text[pos] == '{') {
+                    result = ParseBounds(begin, result, nfa.states.size() - first_state);
+                    continue;
+                }
+                char op = text[pos++];
+                result = Repeat(nfa, result, op != '+', op != '?');
+            }
+            return result;
+        }
+
+        static constexpr size_t MAX_REPEAT = 1000;
+
+        // {m}, {m,} or {m,n} after the item text[begin, pos), which took item_states NFA
+        // states. A fragment cannot be copied, so the item is parsed again for every
+        // repetition after the first; the copies are checked against the NFA budget first.
+        Fragment ParseBounds(size_t begin, Fragment item, size_t item_states) {
+            const size_t end = pos++;
+            auto bad_bounds = [this] {
+                return invalid_argument("bad {m,n} in pattern " + string(text));
+            };
+            auto number = [&]() -> optional<size_t> {
+                if (pos == text.size() || !isdigit(static_cast<unsigned char>(text[pos]))) return nullopt;
+                size_t value = 0;
+                while (pos < text.size() && isdigit(static_cast<unsigned char>(text[pos]))) {
+                    value = value * 10 + (text[pos++] - '0');
+                    if (value > MAX_REPEAT) throw bad_bounds();
+                }
+                return value;
+            };
+            const optional<size_t> low = number();
+            optional<size_t> high = low;
+            if (pos < text.size() && text[pos] == ',') {
+                ++pos;
+                high = number();
+            }
+            if (!low || pos == text.size() || text[pos] != '}' || (high && *high < *low)) {
+                throw bad_bounds();
+            }
+            ++pos;
+            const size_t copies = high ? *high : *low + 1;
+            if (copies > 1 && item_states * (copies - 1) > nfa.limit - nfa.states.size()) {
+                throw invalid_argument("pattern needs more than " + to_string(MAX_PATTERN_STATES) + " NFA states");
+            }
+
+            size_t used = 0;
+            auto next_copy = [&] {
+                return used++ == 0 ? item : RegexParser{ nfa, text.substr(0, end), begin }.ParseRepetition();
+            };
+            Fragment result = PatternDfa::Empty(nfa);
+            for (size_t i = 0; i < *low; ++i) {
+                result = Concat(nfa, result, next_copy());
+            }
+            if (!high) {
+                return Concat(nfa, result, Repeat(nfa, next_copy(), true, true));
+            }
+            for (size_t i = *low; i < *high; ++i) {
+                result = Concat(nfa, result, Repeat(nfa, next_copy(), true, false));
+            }
+            return result;
+        }
+
+        Fragment ParseAtom() {
+            char c = text[pos++];
+            switch (c) {
+            case '(': {
+                Fragment result = ParseAlternation();
+                if (pos == text.size() || text[pos] != ')') {
+                    throw invalid_argument("unbalanced ( in pattern " + string(text));
+                }
+                ++pos;
+                return result;
+            }
+            case '[':
+                return CharSet(nfa, ParseClass(text, pos, true));
+            case '.':
+                return AnyChar(nfa);
+            case '*': case '+': case '?': case '{':
+                throw invalid_argument("nothing to repeat in pattern " + string(text));
+            case '^': case '$':
+                throw invalid_argument("patterns match whole words, anchors are not supported in " + string(text));
+            case '\\': {
+                if (pos == text.size()) {
+                    throw invalid_argument("trailing \\ in pattern " + string(text));
+                }
+                const char escaped = text[pos++];
+                if (auto chars = ShorthandClass(escaped)) {
+                    return CharSet(nfa, move(*chars));
+                }
+                if (isalnum(static_cast<unsigned char>(escaped))) {
+                    throw invalid_argument("unsupported escape in pattern " + string(text));
+                }
+                return Literal(nfa, escaped);
+            }
+            default:
+                return Literal(nfa, c);
+            }
+        }
+    };
+
+    // Bytes that no pattern tells apart share a column of the transition table
+    void BuildByteClasses(const Nfa& nfa) {
+        byte_class_.assign(256, 0);
+        class_count_ = 1;
+        for (const auto& state : nfa.states) {
+            if (state.next == NONE) continue;
+            map<pair<uint8_t, bool>, uint8_t> split;
+            for (size_t c = 0; c < 256; ++c) {
+                auto key = make_pair(byte_class_[c], static_cast<bool>(state.chars[c]));
+                auto it = split.emplace(key, static_cast<uint8_t>(split.size())).first;
+                byte_class_[c] = it->second;
+            }
+            class_count_ = split.size();
+        }
+    }
+
+    static vector<size_t> Closure(const Nfa& nfa, vector<size_t> states) {
+        vector<bool> seen(nfa.states.size());
+        for (size_t state : states) seen[state] = true;
+        for (size_t i = 0; i < states.size(); ++i) {
+            for (size_t next : nfa.states[states[i]].epsilon) {
+                if (!seen[next]) {
+                    seen[next] = true;
+                    states.push_back(next);
+                }
+            }
+        }
+        sort(states.begin(), states.end());
+        return states;
+    }
+
+    // Subset construction can grow exponentially with the pattern (".*a.{20}" needs
+    // 2^21 states), so the DFA may have at most max_states, which grows with the NFA:
+    // linear pattern lists stay well inside it however long they are
+    void BuildSubsets(const Nfa& nfa, size_t nfa_start) {
+        const size_t max_states = max<size_t>(10000, 4 * nfa.states.size());
+        vector<uint8_t> representative(class_count_);
+        for (size_t c = 256; c-- > 0;) {
+            representative[byte_class_[c]] = static_cast<uint8_t>(c);
+        }
+
+        map<vector<size_t>, uint32_t> ids;
+        vector<vector<size_t>> subsets;
+        auto get_id = [&](vector<size_t> subset) {
+            auto [it, inserted] = ids.emplace(subset, static_cast<uint32_t>(subsets.size()));
+            if (inserted) {
+                if (subsets.size() == max_states) {
+                    throw invalid_argument("patterns need more than " + to_string(max_states) + " DFA states");
+                }
+                subsets.push_back(move(subset));
+            }
+            return it->second;
+        };
+
+        dead_ = get_id({});
+        start_ = get_id(Closure(nfa, { nfa_start }));
+        for (size_t i = 0; i < subsets.size(); ++i) {
+            transitions_.resize((i + 1) * class_count_);
+            set<size_t> accept;
+            for (size_t state : subsets[i]) {
+                if (nfa.states[state].accept != NONE) accept.insert(nfa.states[state].accept);
+            }
+            accepts_.emplace_back(accept.begin(), accept.end());
+            for (size_t cls = 0; cls < class_count_; ++cls) {
+                vector<size_t> moved;
+                for (size_t state : subsets[i]) {
+                    const auto& nfa_state = nfa.states[state];
+                    if (nfa_state.next != NONE && nfa_state.chars[representative[cls]]) {
+                        moved.push_back(nfa_state.next);
+                    }
+                }
+                uint32_t target = get_id(Closure(nfa, move(moved)));
+                transitions_[i * class_count_ + cls] = target;
+            }
+        }
+    }
+
+    // Moore partition refinement, starting from states grouped by accepted pattern set
+    void Minimize() {
+        const size_t state_count = accepts_.size();
+        vector<uint32_t> block(state_count);
+        size_t block_count = 0;
+        {
+            map<vector<size_t>, uint32_t> initial;
+            for (size_t s = 0; s < state_count; ++s) {
+                block[s] = initial.emplace(accepts_[s], static_cast<uint32_t>(initial.size())).first->second;
+            }
+            block_count = initial.size();
+        }
+        while (true) {
+            map<vector<uint32_t>, uint32_t> signatures;
+            vector<uint32_t> next_block(state_count);
+            for (size_t s = 0; s < state_count; ++s) {
+                vector<uint32_t> signature = { block[s] };
+                for (size_t cls = 0; cls < class_count_; ++cls) {
+                    signature.push_back(block[transitions_[s * class_count_ + cls]]);
+                }
+                next_block[s] = signatures.emplace(move(signature), static_cast<uint32_t>(signatures.size())).first->second;
+            }
+            block = move(next_block);
+            if (signatures.size() == block_count) break;
+            block_count = signatures.size();
+        }
+
+        vector<uint32_t> transitions(block_count * class_count_);
+        vector<vector<size_t>> accepts(block_count);
+        for (size_t s = 0; s < state_count; ++s) {
+            for (size_t cls = 0; cls < class_count_; ++cls) {
+                transitions[block[s] * class_count_ + cls] = block[transitions_[s * class_count_ + cls]];
+            }
+            accepts[block[s]] = accepts_[s];
+        }
+        transitions_ = move(transitions);
+        accepts_ = move(accepts);
+        start_ = block[start_];
+        dead_ = block[dead_];
+    }
+
+    vector<uint8_t> byte_class_;
+    size_t class_count_ = 0;
+    vector<uint32_t> transitions_;
+    vector<vector<size_t>> accepts_;
+    uint32_t start_ = 0;
+    uint32_t dead_ = 0;
+};
+
+struct PrefilterCounters {
+    size_t rejected = 0;
+    size_t hits = 0;
+    size_t false_positives = 0;
+
+    double FalsePositiveRate() const {
+        size_t negatives = rejected + false_positives;
+        return negatives == 0 ? 0.0 : static_cast<double>(false_positives) / negatives;
+    }
+
+    void operator += (const PrefilterCounters& other) {
+        rejected += other.rejected;
+        hits += other.hits;
+        false_positives += other.false_positives;
+    }
+};
+
+// All probes for a key fall into one 512-bit block, so a lookup touches a single cache line
+class BlockedBloomFilter {
+public:
+    BlockedBloomFilter() = default;
+
+    BlockedBloomFilter(size_t key_count, size_t bits_per_key)
+        : blocks_(max<size_t>(1, (key_count * bits_per_key + 511) / 512)),
+        probes_(clamp<size_t>(static_cast<size_t>(lround(bits_per_key * 0.69)), 1, 7)) {
+    }
+
+    bool Enabled() const {
+        return !blocks_.empty();
+    }
+
+    void Insert(string_view key) {
+        uint64_t hash = std::hash<string_view>()(key);
+        auto& block = blocks_[hash % blocks_.size()];
+        uint64_t bits = Mix(hash);
+        for (size_t i = 0; i < probes_; ++i, bits >>= 9) {
+            block.words[(bits & 511) >> 6] |= uint64_t(1) << (bits & 63);
+        }
+    }
+
+    bool MayContain(string_view key) const {
+        uint64_t hash = std::hash<string_view>()(key);
+        const auto& block = blocks_[hash % blocks_.size()];
+        uint64_t bits = Mix(hash);
+        for (size_t i = 0; i < probes_; ++i, bits >>= 9) {
+            if ((block.words[(bits & 511) >> 6] & (uint64_t(1) << (bits & 63))) == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+private:
+    struct alignas(64) Block {
+        uint64_t words[8] = {};
+    };
+
+    static uint64_t Mix(uint64_t hash) {
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdull;
+        hash ^= hash >> 33;
+        return hash;
+    }
+
+    vector<Block> blocks_;
+    size_t probes_ = 0;
+};
+
+class KeyWordsDictionary {
+public:
+    static constexpr size_t NPOS = static_cast<size_t>(-1);
+    static constexpr size_t PREFILTER_MIN_KEYWORDS = 1 << 16;
+
+    explicit KeyWordsDictionary(const set<string>& key_words, const vector<KeyWordPattern>& patterns = {})
+        : words_(key_words.begin(), key_words.end()),
+        exact_count_(words_.size()) {
+        vector<KeyWordPattern> unique_patterns;
+        set<string> seen(key_words);
+        for (const auto& pattern : patterns) {
+            if (seen.insert(pattern.text).second) {
+                unique_patterns.push_back(pattern);
+                words_.push_back(pattern.text);
+            }
+        }
+        patterns_ = PatternDfa(unique_patterns);
+        ids_.reserve(exact_count_);
+        for (size_t id = 0; id < exact_count_; ++id) {
+            ids_[words_[id]] = id;
+        }
+        if (exact_count_ >= PREFILTER_MIN_KEYWORDS) {
+            BuildPrefilter();
+        }
+    }
+
+    // ids_ holds views into words_, so a copy would dangle
+    KeyWordsDictionary(const KeyWordsDictionary&) = delete;
+    KeyWordsDictionary& operator = (const KeyWordsDictionary&) = delete;
+    KeyWordsDictionary(KeyWordsDictionary&&) = default;
+    KeyWordsDictionary& operator = (KeyWordsDictionary&&) = default;
+
+    void BuildPrefilter(size_t bits_per_key = 10) {
+        prefilter_ = BlockedBloomFilter(exact_count_, bits_per_key);
+        for (size_t id = 0; id < exact_count_; ++id) {
+            prefilter_.Insert(words_[id]);
+        }
+    }
+
+    bool HasPrefilter() const {
+        return prefilter_.Enabled();
+    }
+
+    size_t Find(string_view word, PrefilterCounters* counters = nullptr) const {
+        if (prefilter_.Enabled() && !prefilter_.MayContain(word)) {
+            if (counters) ++counters->rejected;
+            return NPOS;
+        }
+        auto it = ids_.find(word);
+        if (prefilter_.Enabled() && counters) {
+            ++(it == ids_.end() ? counters->false_positives : counters->hits);
+        }
+        return it == ids_.end() ? NPOS : it->second;
+    }
+
+    template <typename Callback>
+    void ForEachMatch(string_view word, Callback callback, PrefilterCounters* counters = nullptr) const {
+        size_t id = Find(word, counters);
+        if (id != NPOS) {
+            callback(id);
+        }
+        patterns_.ForEachMatch(word, [&](size_t pattern_id) {
+            callback(exact_count_ + pattern_id);
+        });
+    }
+
+    size_t Size() const {
+        return words_.size();
+    }
+
+    const string& Word(size_t id) const {
+        return words_[id];
+    }
+
+    // FNV-1a over the id -> keyword mapping, used to check that count vectors are compatible
+    uint64_t Fingerprint() const {
+        uint64_t hash = 14695981039346656037ull;
+        auto mix = [&hash](unsigned char c) {
+            hash = (hash ^ c) * 1099511628211ull;
+        };
+        for (size_t id = 0; id < words_.size(); ++id) {
+            for (char c : words_[id]) mix(c);
+            mix(id < exact_count_ ? 0 : 1);
+        }
+        return hash;
+    }
+
+    Stats ToStats(const vector<int>& counts) const {
+        Stats result;
+        for (size_t id = 0; id < counts.size(); ++id) {
+            if (counts[id] > 0) {
+                result.word_frequences[words_[id]] = counts[id];
+            }
+        }
+        return result;
+    }
+private:
+    vector<string> words_;
+    size_t exact_count_;
+    unordered_map<string_view, size_t> ids_;
+    PatternDfa patterns_;
+    BlockedBloomFilter prefilter_;
+};
+
+void AddCounts(vector<int>& to, const vector<int>& from) {
+    if (to.size() < from.size()) {
+        to.resize(from.size());
+    }
+    for (size_t i = 0; i < from.size(); ++i) {
+        to[i] += from[i];
+    }
+}
+
+// Only KeyWordsDictionary reports prefilter counters; other matchers ignore them
+template <typename Dictionary, typename Callback>
+void ForEachDictionaryMatch(const Dictionary& dictionary, string_view word, Callback callback, PrefilterCounters*) {
+    dictionary.ForEachMatch(word, callback);
+}
+
+template <typename Callback>
+void ForEachDictionaryMatch(const KeyWordsDictionary& dictionary, string_view word, Callback callback,
+    PrefilterCounters* counters) {
+    dictionary.ForEachMatch(word, callback, counters);
+}
+
+template <typename Dictionary>
+vector<int> CountKeyWords(const Dictionary& dictionary, istream& input);
+
+template <typename Dictionary>
+vector<int> CountLinesVector(const Dictionary& dictionary, vector<string> input) {
+    vector<int> counts(dictionary.Size());
+    for (const auto& line : input) {
+        ForEachWord(line, [&](string_view word) {
+            dictionary.ForEachMatch(word, [&](size_t id) {
+                ++counts[id];
+            });
+        });
+    }
+    return counts;
+}
+
+class MultiQueryMatcher {
+public:
+    explicit MultiQueryMatcher(const vector<set<string>>& queries)
+        : query_count_(queries.size()),
+        dictionary_(Union(queries)),
+        query_masks_(dictionary_.Size(), vector<uint64_t>((query_count_ + 63) / 64)) {
+        for (size_t query = 0; query < query_count_; ++query) {
+            for (const auto& word : queries[query]) {
+                query_masks_[dictionary_.Find(word)][query / 64] |= uint64_t(1) << (query % 64);
+            }
+        }
+    }
+
+    const KeyWordsDictionary& Dictionary() const {
+        return dictionary_;
+    }
+
+    vector<Stats> Split(const vector<int>& counts) const {
+        vector<Stats> result(query_count_);
+        for (size_t id = 0; id < counts.size(); ++id) {
+            if (counts[id] == 0) continue;
+            const auto& mask = query_masks_[id];
+            for (size_t block = 0; block < mask.size(); ++block) {
+                for (uint64_t bits = mask[block]; bits != 0; bits &= bits - 1) {
+                    size_t query = block * 64 + CountTrailingZeros(bits);
+                    result[query].word_frequences[dictionary_.Word(id)] = counts[id];
+                }
+            }
+        }
+        return result;
+    }
+private:
+    size_t query_count_;
+    KeyWordsDictionary dictionary_;
+    vector<vector<uint64_t>> query_masks_;
+
+    static set<string> Union(const vector<set<string>>& queries) {
+        set<string> result;
+        for (const auto& query : queries) {
+            result.insert(query.begin(), query.end());
+        }
+        return result;
+    }
+
+    static size_t CountTrailingZeros(uint64_t bits) {
+        size_t result = 0;
+        while ((bits & 1) == 0) {
+            bits >>= 1;
+            ++result;
+        }
+        return result;
+    }
+};
+
+vector<Stats> ExploreQueries(const vector<set<string>>& queries, istream& input) {
+    const MultiQueryMatcher matcher(queries);
+    return matcher.Split(CountKeyWords(matcher.Dictionary(), input));
+}
+
+void TestMultiQuery() {
+    const vector<set<string>> queries = {
+        { "yangle", "rocks", "sucks", "all" },
+        { "yangle", "Goondex" },
+        { "suck", "IT", "rocks." },
+        {}
+    };
+    const int OPERATIONS = 3000;
+
+    string text = MakeYangleText(OPERATIONS);
+
+    stringstream ss(text);
+    const auto stats = ExploreQueries(queries, ss);
+    ASSERT_EQUAL(stats.size(), queries.size());
+    for (size_t i = 0; i < queries.size(); ++i) {
+        stringstream single(text);
+        AssertEqual(stats[i].word_frequences,
+            ExploreKeyWords(queries[i], single).word_frequences,
+            "Query = " + to_string(i));
+    }
+    ASSERT_EQUAL(stats[1].word_frequences.at("Goondex"), OPERATIONS);
+    ASSERT(stats[3].word_frequences.empty());
+}
+
+Stats ExploreKeyWords(const set<string>& key_words, istream& input) {
+    const KeyWordsDictionary dictionary(key_words);
+    return dictionary.ToStats(CountKeyWords(dictionary, input));
+}
+
+Stats ExploreKeyWords(const set<string>& key_words, const vector<KeyWordPattern>& patterns, istream& input) {
+    const KeyWordsDictionary dictionary(key_words, patterns);
+    return dictionary.ToStats(CountKeyWords(dictionary, input));
+}
+
+void TestPatterns() {
+    using Kind = KeyWordPattern::Kind;
+    const set<string> key_words = { "yangle", "rocks" };
+    const vector<KeyWordPattern> patterns = {
+        { Kind::Glob, "err*" },
+        { Kind::Regex, "user_[0-9]+" },
+        { Kind::Regex, "(ya|yo)ngle" },
+        { Kind::Glob, "?ocks" },
+        { Kind::Glob, "rocks" },
+        { Kind::Regex, "[^a-z]*" }
+    };
+
+    stringstream ss;
+    ss << "error user_12 yangle rocks\n";
+    ss << "err errno user_ user_x user_007 yongle\n";
+    ss << "socks rocks. 42 -- Rocks\n";
+
+    const auto stats = ExploreKeyWords(key_words, patterns, ss);
+    const map<string, int> expected = {
+      {"yangle", 1},
+      {"rocks", 1},
+      {"err*", 3},
+      {"user_[0-9]+", 2},
+      {"(ya|yo)ngle", 2},
+      {"?ocks", 3},
+      {"[^a-z]*", 2}
+    };
+    ASSERT_EQUAL(stats.word_frequences, expected);
+
+    const vector<KeyWordPattern> extended_patterns = {
+        { Kind::Regex, "user_\\d+" },
+        { Kind::Regex, "a{2}" },
+        { Kind::Regex, "a{2,}" },
+        { Kind::Regex, "x{1,3}y" },
+        { Kind::Regex, "[\\d-]{3}" },
+        { Kind::Regex, "b\\w\\d" },
+        { Kind::Regex, "\\.\\S" },
+        { Kind::Regex, "[!?]x" }
+    };
+    stringstream extended;
+    extended << "user_12 user_ddd aa aaa a{2} xy xxxy xxxxy 4-2 b_7 bx7 .x !x ?x ax\n";
+    const map<string, int> extended_expected = {
+      {"user_\\d+", 1},
+      {"a{2}", 1},
+      {"a{2,}", 2},
+      {"x{1,3}y", 2},
+      {"[\\d-]{3}", 1},
+      {"b\\w\\d", 2},
+      {"\\.\\S", 1},
+      {"[!?]x", 2}
+    };
+    ASSERT_EQUAL(ExploreKeyWords({}, extended_patterns, extended).word_frequences, extended_expected);
+
+    for (const string bad : { "user_\\q", "{2}", "a{3,1}", "a{2", "a{,2}", "a{1001}", "^a", "a$", "a\\", "[\\q]", ".*a.{20}",
+        "(a{1000}){1000}", "((a{1000}){1000}){1000}" }) {
+        bool thrown = false;
+        try {
+            PatternDfa(vector<KeyWordPattern>{ { Kind::Regex, bad } });
+        } catch (invalid_argument&) {
+            thrown = true;
+        }
+        AssertEqual(thrown, true, bad);
+    }
+
+    vector<KeyWordPattern> services;
+    for (int i = 0; i < 5000; ++i) {
+        services.push_back({ Kind::Glob, "service" + to_string(i) + "_*" });
+    }
+    const PatternDfa service_dfa(services);
+    vector<size_t> service_ids;
+    service_dfa.ForEachMatch("service4242_eu", [&service_ids](size_t id) { service_ids.push_back(id); });
+    ASSERT_EQUAL(service_ids, vector<size_t>({ 4242 }));
+}
+
+void TestPatternDfaMinimized() {
+    using Kind = KeyWordPattern::Kind;
+    const PatternDfa star(vector<KeyWordPattern>{ { Kind::Regex, "(a|b)*c" } });
+    const PatternDfa classes(vector<KeyWordPattern>{ { Kind::Regex, "[ab]*c" } });
+    ASSERT_EQUAL(star.StateCount(), 3u);
+    ASSERT_EQUAL(classes.StateCount(), 3u);
+
+    const PatternDfa shared(vector<KeyWordPattern>{
+        { Kind::Glob, "user_*" }, { Kind::Regex, "user_[0-9]+" }
+    });
+    vector<size_t> ids;
+    shared.ForEachMatch("user_12", [&ids](size_t id) { ids.push_back(id); });
+    ASSERT_EQUAL(ids, vector<size_t>({ 0, 1 }));
+
+    bool thrown = false;
+    try {
+        PatternDfa(vector<KeyWordPattern>{ { Kind::Regex, "(ab" } });
+    } catch (invalid_argument&) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+}
+
+struct VersionedDictionary {
+    size_t version;
+    KeyWordsDictionary dictionary;
+};
+
+// Readers take a snapshot once per page; a retired dictionary is freed
+// when the last page counting under it drops its reference
+class KeyWordsPublisher {
+public:
+    explicit KeyWordsPublisher(const set<string>& key_words, const vector<KeyWordPattern>& patterns = {}) {
+        Publish(key_words, patterns);
+    }
+
+    size_t Publish(const set<string>& key_words, const vector<KeyWordPattern>& patterns = {}) {
+        auto compiled = make_shared<VersionedDictionary>(
+            VersionedDictionary{ 0, KeyWordsDictionary(key_words, patterns) });
+        lock_guard<mutex> guard(publish_mutex_);
+        compiled->version = ++last_version_;
+        atomic_store(&current_, shared_ptr<const VersionedDictionary>(move(compiled)));
+        return last_version_;
+    }
+
+    shared_ptr<const VersionedDictionary> Current() const {
+        return atomic_load(&current_);
+    }
+private:
+    mutex publish_mutex_;
+    size_t last_version_ = 0;
+    shared_ptr<const VersionedDictionary> current_;
+};
+
+struct PageStats {
+    size_t version;
+    Stats stats;
+    size_t sequence = 0;
+};
+
+PageStats ExploreLinesVersioned(shared_ptr<const VersionedDictionary> snapshot, vector<string> input) {
+    const auto counts = CountLinesVector(snapshot->dictionary, move(input));
+    return { snapshot->version, snapshot->dictionary.ToStats(counts) };
+}
+
+struct Page {
+    size_t sequence = 0;
+    vector<string> lines;
+    uint64_t offset = 0;
+    // Set only by streaming scans: the dictionary current when the page was read
+    shared_ptr<const VersionedDictionary> dictionary;
+};
+
+class PageQueue {
+public:
+    explicit PageQueue(size_t capacity)
+        : capacity_(capacity) {
+    }
+
+    bool Push(Page page) {
+        unique_lock<mutex> lock(m_);
+        not_full_.wait(lock, [this] { return pages_.size() < capacity_ || closed_; });
+        if (closed_) return false;
+        pages_.push_back(move(page));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    bool Pop(Page& page) {
+        unique_lock<mutex> lock(m_);
+        not_empty_.wait(lock, [this] { return !pages_.empty() || closed_; });
+        if (pages_.empty()) return false;
+        page = move(pages_.front());
+        pages_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    void Close() {
+        lock_guard<mutex> guard(m_);
+        closed_ = true;
+        not_empty_.notify_all();
+        not_full_.notify_all();
+    }
+
+    void Cancel() {
+        lock_guard<mutex> guard(m_);
+        closed_ = true;
+        pages_.clear();
+        not_empty_.notify_all();
+        not_full_.notify_all();
+    }
+private:
+    size_t capacity_;
+    deque<Page> pages_;
+    bool closed_ = false;
+    mutex m_;
+    condition_variable not_empty_;
+    condition_variable not_full_;
+};
+
+// Closes the queue when leaving scope, so that workers blocked in Pop return
+// even when the reader stops with an exception
+class PageQueueCloser {
+public:
+    explicit PageQueueCloser(PageQueue& queue)
+        : queue_(queue) {
+    }
+
+    ~PageQueueCloser() {
+        queue_.Close();
+    }
+private:
+    PageQueue& queue_;
+};
+
+// Direct-mapped: a line evicts whatever else hashed to its slot
+class LineCache {
+public:
+    explicit LineCache(size_t capacity)
+        : slots_(capacity) {
+    }
+
+    const vector<size_t>* Find(const string& line, size_t hash) const {
+        const auto& slot = slots_[hash % slots_.size()];
+        if (slot.used && slot.hash == hash && slot.line == line) {
+            return &slot.hits;
+        }
+        return nullptr;
+    }
+
+    void Store(const string& line, size_t hash, vector<size_t> hits) {
+        auto& slot = slots_[hash % slots_.size()];
+        slot.used = true;
+        slot.hash = hash;
+        slot.line = line;
+        slot.hits = move(hits);
+    }
+private:
+    struct Slot {
+        bool used = false;
+        size_t hash = 0;
+        string line;
+        vector<size_t> hits;
+    };
+    vector<Slot> slots_;
+};
+
+struct ThresholdQuery {
+    enum class Mode { None, AnyReaches, AllReach, FirstMatches };
+
+    Mode mode = Mode::None;
+    int count = 0;
+};
+
+class ThresholdTracker {
+public:
+    ThresholdTracker(const ThresholdQuery& query, size_t keyword_count)
+        : query_(query),
+        totals_(query.mode == ThresholdQuery::Mode::None ? 0 : keyword_count),
+        reached_(query.mode != ThresholdQuery::Mode::None
+            && (query.count <= 0 || (query.mode == ThresholdQuery::Mode::AllReach && keyword_count == 0))) {
+    }
+
+    bool Active() const {
+        return query_.mode != ThresholdQuery::Mode::None;
+    }
+
+    bool Reached() const {
+        return reached_.load(memory_order_relaxed);
+    }
+
+    // Returns true when these hits answer the query
+    bool Add(const vector<size_t>& hits) {
+        bool reached = false;
+        switch (query_.mode) {
+        case ThresholdQuery::Mode::AnyReaches:
+            for (size_t id : hits) {
+                reached |= totals_[id].fetch_add(1, memory_order_relaxed) + 1 >= query_.count;
+            }
+            break;
+        case ThresholdQuery::Mode::AllReach:
+            for (size_t id : hits) {
+                if (totals_[id].fetch_add(1, memory_order_relaxed) + 1 == query_.count) {
+                    reached |= keywords_done_.fetch_add(1, memory_order_relaxed) + 1 == totals_.size();
+                }
+            }
+            break;
+        case ThresholdQuery::Mode::FirstMatches:
+            reached = !hits.empty()
+                && matches_.fetch_add(static_cast<int>(hits.size()), memory_order_relaxed)
+                    + static_cast<int>(hits.size()) >= query_.count;
+            break;
+        case ThresholdQuery::Mode::None:
+            break;
+        }
+        if (reached) {
+            reached_.store(true, memory_order_relaxed);
+        }
+        return reached;
+    }
+private:
+    ThresholdQuery query_;
+    vector<atomic<int>> totals_;
+    atomic<size_t> keywords_done_{ 0 };
+    atomic<int> matches_{ 0 };
+    atomic<bool> reached_;
+};
+
+class CancellationToken {
+public:
+    void Cancel() {
+        cancelled_.store(true, memory_order_relaxed);
+    }
+
+    bool IsCancelled() const {
+        return cancelled_.load(memory_order_relaxed);
+    }
+private:
+    atomic<bool> cancelled_{ false };
+};
+
+struct ScanProgress {
+    size_t bytes_read = 0;
+    size_t lines_read = 0;
+    size_t pages_completed = 0;
+    size_t pages_in_flight = 0;
+    double megabytes_per_second = 0;
+    vector<double> worker_utilization;
+};
+
+struct ScanOptions {
+    // PerWorker keeps private counts merged after the scan; the atomic modes count into
+    // one shared padded array (or one per stripe of workers), suited to small keyword
+    // sets; PerThreadRows gives each worker thread its own padded row of ShardedCounters
+    enum class Accumulation { PerWorker, SharedAtomic, StripedAtomic, PerThreadRows };
+
+    size_t worker_count = DefaultWorkerCount();
+    size_t page_size = 10000;
+    size_t line_cache_capacity = 0;
+    ThresholdQuery threshold;
+    const CancellationToken* cancellation = nullptr;
+    steady_clock::time_point deadline = steady_clock::time_point::max();
+    function<void(const ScanProgress&)> on_progress;
+    steady_clock::duration progress_interval = 1s;
+    bool cooccurrence = false;
+    Accumulation accumulation = Accumulation::PerWorker;
+};
+
+struct ScanInstrumentation {
+    size_t lines = 0;
+    size_t cache_hits = 0;
+    size_t cache_misses = 0;
+    PrefilterCounters prefilter;
+
+    double CacheHitRate() const {
+        size_t lookups = cache_hits + cache_misses;
+        return lookups == 0 ? 0.0 : static_cast<double>(cache_hits) / lookups;
+    }
+
+    void operator += (const ScanInstrumentation& other) {
+        lines += other.lines;
+        cache_hits += other.cache_hits;
+        cache_misses += other.cache_misses;
+        prefilter += other.prefilter;
+    }
+};
+
+// Counts lines containing both keywords of a pair; the diagonal counts lines
+// containing the keyword at all. Small keyword sets use a dense upper triangle,
+// larger ones a hash of the pairs that actually occur
+class CooccurrenceMatrix {
+public:
+    // The dense triangle (about 2 MB at the default limit) is only allocated once a
+    // line actually hits a keyword, so idle workers cost nothing
+    explicit CooccurrenceMatrix(size_t keyword_count = 0, size_t dense_limit = 1024)
+        : keyword_count_(keyword_count),
+        is_dense_(keyword_count <= dense_limit) {
+    }
+
+    size_t KeyWordCount() const {
+        return keyword_count_;
+    }
+
+    bool IsDense() const {
+        return is_dense_;
+    }
+
+    // ids must be sorted and unique
+    void AddLine(const vector<size_t>& ids) {
+        if (is_dense_ && dense_.empty() && !ids.empty()) {
+            dense_.resize(keyword_count_ * (keyword_count_ + 1) / 2);
+        }
+        for (size_t j = 0; j < ids.size(); ++j) {
+            for (size_t i = 0; i <= j; ++i) {
+                if (IsDense()) {
+                    ++dense_[Index(ids[i], ids[j])];
+                } else {
+                    ++sparse_[Index(ids[i], ids[j])];
+                }
+            }
+        }
+    }
+
+    int Get(size_t a, size_t b) const {
+        size_t index = Index(min(a, b), max(a, b));
+        if (IsDense()) return dense_.empty() ? 0 : dense_[index];
+        auto it = sparse_.find(index);
+        return it == sparse_.end() ? 0 : it->second;
+    }
+
+    void operator += (const CooccurrenceMatrix& other) {
+        if (keyword_count_ == 0) {
+            *this = other;
+            return;
+        }
+        if (IsDense()) {
+            AddCounts(dense_, other.dense_);
+        } else {
+            for (const auto& [index, count] : other.sparse_) {
+                sparse_[index] += count;
+            }
+        }
+    }
+
+    map<pair<string, string>, int> ToPairs(const KeyWordsDictionary& dictionary) const {
+        map<pair<string, string>, int> result;
+        if (!IsDense()) {
+            // Only the recorded pairs: scanning the triangle would cost K^2 lookups
+            for (const auto& [index, count] : sparse_) {
+                const auto [i, j] = Unindex(index);
+                if (i != j && count > 0) {
+                    result[minmax(dictionary.Word(i), dictionary.Word(j))] = count;
+                }
+            }
+            return result;
+        }
+        if (dense_.empty()) return result;
+        for (size_t j = 0; j < keyword_count_; ++j) {
+            for (size_t i = 0; i < j; ++i) {
+                if (int count = dense_[Index(i, j)]; count > 0) {
+                    result[minmax(dictionary.Word(i), dictionary.Word(j))] = count;
+                }
+            }
+        }
+        return result;
+    }
+private:
+    size_t keyword_count_;
+    bool is_dense_;
+    vector<int> dense_;
+    unordered_map<size_t, int> sparse_;
+
+    static size_t Index(size_t i, size_t j) {
+        return j * (j + 1) / 2 + i;
+    }
+
+    // Inverse of Index; the square root only guesses j, the loops correct rounding
+    static pair<size_t, size_t> Unindex(size_t index) {
+        size_t j = static_cast<size_t>((sqrt(8.0 * index + 1) - 1) / 2);
+        while (j * (j + 1) / 2 > index) --j;
+        while ((j + 1) * (j + 2) / 2 <= index) ++j;
+        return { index - j * (j + 1) / 2, j };
+    }
+};
+
+struct ScanCoverage {
+    bool complete = false;
+    size_t pages_completed = 0;
+    size_t bytes_completed = 0;
+    optional<size_t> total_bytes;
+
+    // Share of the input that the counts cover, when the input size is known
+    optional<double> Fraction() const {
+        if (complete) return 1.0;
+        if (!total_bytes || *total_bytes == 0) return nullopt;
+        return min(1.0, static_cast<double>(bytes_completed) / *total_bytes);
+    }
+};
+
+struct ScanResult {
+    vector<int> counts;
+    ScanInstrumentation instrumentation;
+    bool threshold_reached = false;
+    bool cancelled = false;
+    bool deadline_exceeded = false;
+    ScanCoverage coverage;
+    CooccurrenceMatrix cooccurrence;
+};
+
+// Written once per page by the reader and the workers, read by the progress monitor
+class ScanProgressCounters {
+public:
+    explicit ScanProgressCounters(size_t worker_count)
+        : workers_(worker_count) {
+    }
+
+    void PageRead(size_t lines, size_t bytes) {
+        lines_read_.fetch_add(lines, memory_order_relaxed);
+        bytes_read_.fetch_add(bytes, memory_order_relaxed);
+        pages_read_.fetch_add(1, memory_order_relaxed);
+    }
+
+    void PageStarted(size_t worker) {
+        workers_[worker].busy_since.store(Now(), memory_order_relaxed);
+    }
+
+    void PageFinished(size_t worker) {
+        auto& activity = workers_[worker];
+        activity.busy.fetch_add(Now() - activity.busy_since.load(memory_order_relaxed), memory_order_relaxed);
+        activity.busy_since.store(0, memory_order_relaxed);
+        pages_completed_.fetch_add(1, memory_order_relaxed);
+    }
+
+    ScanProgress Snapshot(vector<int64_t>& busy) const {
+        ScanProgress progress;
+        progress.bytes_read = bytes_read_.load(memory_order_relaxed);
+        progress.lines_read = lines_read_.load(memory_order_relaxed);
+        progress.pages_completed = pages_completed_.load(memory_order_relaxed);
+        size_t pages_read = pages_read_.load(memory_order_relaxed);
+        progress.pages_in_flight = pages_read > progress.pages_completed ? pages_read - progress.pages_completed : 0;
+        const int64_t now = Now();
+        busy.resize(workers_.size());
+        for (size_t i = 0; i < workers_.size(); ++i) {
+            int64_t since = workers_[i].busy_since.load(memory_order_relaxed);
+            busy[i] = workers_[i].busy.load(memory_order_relaxed) + (since == 0 ? 0 : now - since);
+        }
+        return progress;
+    }
+
+    static int64_t Now() {
+        return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+    }
+private:
+    struct alignas(64) WorkerActivity {
+        atomic<int64_t> busy{ 0 };
+        atomic<int64_t> busy_since{ 0 };
+    };
+
+    alignas(64) atomic<size_t> bytes_read_{ 0 };
+    atomic<size_t> lines_read_{ 0 };
+    atomic<size_t> pages_read_{ 0 };
+    alignas(64) atomic<size_t> pages_completed_{ 0 };
+    vector<WorkerActivity> workers_;
+};
+
+class ProgressMonitor {
+public:
+    ProgressMonitor(const ScanProgressCounters& counters, const ScanOptions& options)
+        : counters_(counters), options_(options) {
+        if (options_.on_progress) {
+            last_time_ = ScanProgressCounters::Now();
+            counters_.Snapshot(last_busy_);
+            thread_ = async(launch::async, [this] { Run(); });
+        }
+    }
+
+    // Stops the monitor thread and delivers the final report
+    void Finish() {
+        if (!thread_.valid()) return;
+        {
+            lock_guard<mutex> guard(m_);
+            finished_ = true;
+        }
+        wake_.notify_all();
+        thread_.get();
+        Report();
+    }
+
+    ~ProgressMonitor() {
+        Finish();
+    }
+private:
+    const ScanProgressCounters& counters_;
+    const ScanOptions& options_;
+    mutex m_;
+    condition_variable wake_;
+    bool finished_ = false;
+    int64_t last_time_ = 0;
+    size_t last_bytes_ = 0;
+    vector<int64_t> last_busy_;
+    future<void> thread_;
+
+    void Run() {
+        unique_lock<mutex> lock(m_);
+        while (!wake_.wait_for(lock, options_.progress_interval, [this] { return finished_; })) {
+            lock.unlock();
+            Report();
+            lock.lock();
+        }
+    }
+
+    void Report() {
+        vector<int64_t> busy;
+        auto progress = counters_.Snapshot(busy);
+        const int64_t now = ScanProgressCounters::Now();
+        const double elapsed = max<int64_t>(now - last_time_, 1);
+        progress.megabytes_per_second = (progress.bytes_read - last_bytes_) / elapsed * 1e9 / (1 << 20);
+        progress.worker_utilization.resize(busy.size());
+        for (size_t i = 0; i < busy.size(); ++i) {
+            progress.worker_utilization[i] = clamp((busy[i] - last_busy_[i]) / elapsed, 0.0, 1.0);
+        }
+        last_time_ = now;
+        last_bytes_ = progress.bytes_read;
+        last_busy_ = move(busy);
+        options_.on_progress(progress);
+    }
+};
+
+// Counters kept in rows of whole cache lines, one row per writer. In PerThread mode
+// (the default) each thread gets its own row on first use; a row then has a single
+// writer, so an increment is a relaxed load and store with no read-modify-write.
+// ApproximateCpu keeps one row per CPU and picks it with sched_getcpu (served from the
+// rseq area on recent glibc). A thread can migrate between that call and the add, so
+// those rows are shared and increments remain fetch_add. This is not a true per-CPU
+// counter: that needs the add itself inside an rseq critical section that the kernel
+// restarts on preemption or migration, which takes per-architecture assembly this file
+// does not carry. Sums are exact once the writers have finished.
+class ShardedCounters {
+public:
+    enum class Mode { PerThread, ApproximateCpu };
+
+    explicit ShardedCounters(size_t counter_count, Mode mode = Mode::PerThread,
+        size_t cpu_slots = thread::hardware_concurrency())
+        : counter_count_(counter_count), mode_(mode), id_(NextInstanceId()) {
+        if (mode_ == Mode::ApproximateCpu) {
+            for (size_t slot = 0; slot < max<size_t>(cpu_slots, 1); ++slot) {
+                rows_.push_back(NewRow());
+            }
+        }
+    }
+
+    ShardedCounters(const ShardedCounters&) = delete;
+    ShardedCounters& operator=(const ShardedCounters&) = delete;
+
+    void Add(size_t index, int64_t delta = 1) {
+        if (mode_ == Mode::PerThread) {
+            auto& value = Slot(ThreadRow(), index);
+            value.store(value.load(memory_order_relaxed) + delta, memory_order_relaxed);
+        } else {
+            Slot(*rows_[CurrentCpu() % rows_.size()], index).fetch_add(delta, memory_order_relaxed);
+        }
+    }
+
+    int64_t Sum(size_t index) const {
+        lock_guard<mutex> guard(m_);
+        int64_t result = 0;
+        for (const auto& row : rows_) {
+            result += Slot(*row, index).load(memory_order_relaxed);
+        }
+        return result;
+    }
+
+    vector<int> Totals() const {
+        lock_guard<mutex> guard(m_);
+        vector<int> result(counter_count_);
+        for (const auto& row : rows_) {
+            for (size_t index = 0; index < counter_count_; ++index) {
+                result[index] += static_cast<int>(Slot(*row, index).load(memory_order_relaxed));
+            }
+        }
+        return result;
+    }
+
+    size_t Size() const {
+        return counter_count_;
+    }
+private:
+    static constexpr size_t COUNTERS_PER_LINE = 64 / sizeof(atomic<int64_t>);
+
+    struct alignas(64) CacheLine {
+        atomic<int64_t> values[COUNTERS_PER_LINE] = {};
+    };
+    using Row = vector<CacheLine>;
+
+    size_t counter_count_;
+    Mode mode_;
+    uint64_t id_;
+    mutable mutex m_;
+    vector<unique_ptr<Row>> rows_;
+    unordered_map<thread::id, Row*> thread_rows_;
+
+    static atomic<int64_t>& Slot(Row& row, size_t index) {
+        return row[index / COUNTERS_PER_LINE].values[index % COUNTERS_PER_LINE];
+    }
+
+    static const atomic<int64_t>& Slot(const Row& row, size_t index) {
+        return row[index / COUNTERS_PER_LINE].values[index % COUNTERS_PER_LINE];
+    }
+
+    unique_ptr<Row> NewRow() const {
+        return make_unique<Row>((counter_count_ + COUNTERS_PER_LINE - 1) / COUNTERS_PER_LINE);
+    }
+
+    // Each thread remembers its row in the last counters object it used, so the
+    // locked lookup only happens on first use or after switching objects
+    Row& ThreadRow() {
+        struct LastRow {
+            uint64_t owner = 0;
+            Row* row = nullptr;
+        };
+        thread_local LastRow last;
+        if (last.owner != id_) {
+            lock_guard<mutex> guard(m_);
+            Row*& row = thread_rows_[this_thread::get_id()];
+            if (!row) {
+                rows_.push_back(NewRow());
+                row = rows_.back().get();
+            }
+            last = { id_, row };
+        }
+        return *last.row;
+    }
+
+    static uint64_t NextInstanceId() {
+        static atomic<uint64_t> next_id{ 1 };
+        return next_id.fetch_add(1, memory_order_relaxed);
+    }
+
+    static size_t CurrentCpu() {
+#ifdef __linux__
+        const int cpu = sched_getcpu();
+        if (cpu >= 0) {
+            return static_cast<size_t>(cpu);
+        }
+#endif
+        static atomic<size_t> next_shard{ 0 };
+        thread_local const size_t shard = next_shard.fetch_add(1, memory_order_relaxed);
+        return shard;
+    }
+};
+
+// One cache line per counter, so workers hitting different keywords never share a line.
+// Striping gives each group of workers its own copy of the array to split contention
+// on hot keywords; totals are summed over the stripes.
+class SharedKeyWordCounters {
+public:
+    SharedKeyWordCounters(size_t keyword_count, size_t stripes)
+        : keyword_count_(keyword_count),
+        stripes_(max<size_t>(stripes, 1)),
+        counters_(keyword_count_ * stripes_) {
+    }
+
+    void Add(size_t worker, size_t id) {
+        counters_[(worker % stripes_) * keyword_count_ + id].value.fetch_add(1, memory_order_relaxed);
+    }
+
+    vector<int> Totals() const {
+        vector<int> result(keyword_count_);
+        for (size_t i = 0; i < counters_.size(); ++i) {
+            result[i % keyword_count_] += static_cast<int>(counters_[i].value.load(memory_order_relaxed));
+        }
+        return result;
+    }
+private:
+    struct alignas(64) PaddedCounter {
+        atomic<int64_t> value{ 0 };
+    };
+
+    size_t keyword_count_;
+    size_t stripes_;
+    vector<PaddedCounter> counters_;
+};
+
+template <typename Dictionary>
+struct ScanContext {
+    const Dictionary& dictionary;
+    const ScanOptions& options;
+    PageQueue queue;
+    ThresholdTracker threshold;
+    ScanProgressCounters progress;
+    unique_ptr<SharedKeyWordCounters> shared_counts;
+    unique_ptr<ShardedCounters> sharded_counts;
+    atomic<bool> cancelled{ false };
+    atomic<bool> deadline_exceeded{ false };
+
+    ScanContext(const Dictionary& dictionary, const ScanOptions& options)
+        : dictionary(dictionary),
+        options(options),
+        queue(2 * options.worker_count),
+        threshold(options.threshold, dictionary.Size()),
+        progress(options.worker_count) {
+        if (options.accumulation == ScanOptions::Accumulation::SharedAtomic) {
+            shared_counts = make_unique<SharedKeyWordCounters>(dictionary.Size(), 1);
+        } else if (options.accumulation == ScanOptions::Accumulation::StripedAtomic) {
+            const size_t cores = max(1u, thread::hardware_concurrency());
+            shared_counts = make_unique<SharedKeyWordCounters>(dictionary.Size(), min(cores, options.worker_count));
+        } else if (options.accumulation == ScanOptions::Accumulation::PerThreadRows) {
+            sharded_counts = make_unique<ShardedCounters>(dictionary.Size());
+        }
+    }
+
+    bool Stopped() const {
+        return threshold.Reached();
+    }
+
+    // Checked once per page: unlike Stopped it may read the clock
+    bool Interrupted() {
+        if (options.cancellation && options.cancellation->IsCancelled()) {
+            cancelled = true;
+        } else if (options.deadline != steady_clock::time_point::max()
+            && steady_clock::now() >= options.deadline) {
+            deadline_exceeded = true;
+        }
+        return Stopped() || cancelled || deadline_exceeded;
+    }
+};
+
+optional<size_t> RemainingBytes(istream& input) {
+    const auto start = input.tellg();
+    if (start == istream::pos_type(-1)) return nullopt;
+    input.seekg(0, ios::end);
+    const auto end = input.tellg();
+    input.seekg(start);
+    if (end == istream::pos_type(-1) || !input) {
+        input.clear();
+        return nullopt;
+    }
+    return static_cast<size_t>(end - start);
+}
+
+struct FeedResult {
+    size_t pages = 0;
+    bool reached_end = false;
+};
+
+// The reader of every page pipeline: numbers the pages, records each page's starting
+// byte offset (and, given a publisher, the dictionary current right after the page was
+// read) and pushes them until the input ends, the queue refuses a page or stop()
+// returns true. Callers close the queue through a PageQueueCloser.
+template <typename Stop>
+FeedResult FeedPages(istream& input, PageQueue& queue, size_t page_size, Stop stop,
+    ScanProgressCounters* progress = nullptr, const KeyWordsPublisher* publisher = nullptr) {
+    FeedResult result;
+    uint64_t offset = 0;
+    while (!stop()) {
+        vector<string> strings = FetchMore(page_size, input);
+        if (strings.empty()) {
+            result.reached_end = true;
+            break;
+        }
+        size_t bytes = 0;
+        for (const auto& line : strings) bytes += line.size() + 1;
+        if (progress) {
+            progress->PageRead(strings.size(), bytes);
+        }
+        Page page{ result.pages++, move(strings), offset, publisher ? publisher->Current() : nullptr };
+        if (!queue.Push(move(page))) break;
+        offset += bytes;
+    }
+    return result;
+}
+
+// Starts the workers of a page pipeline, calling worker(i) on thread i. Workers keep
+// their partial results across every page they pop, so memory follows what each worker
+// has seen rather than the number of pages. A worker that throws cancels the queue, so
+// FeedPages stops instead of waiting for room nobody makes, and the exception comes
+// back through the worker's future.
+template <typename Worker>
+auto StartPageWorkers(PageQueue& queue, size_t worker_count, Worker worker) {
+    using Result = decltype(worker(size_t(0)));
+    vector<future<Result>> workers;
+    for (size_t i = 0; i < worker_count; ++i) {
+        workers.push_back(async(launch::async, [&queue, worker, i]() -> Result {
+            try {
+                return worker(i);
+            } catch (...) {
+                queue.Cancel();
+                throw;
+            }
+        }));
+    }
+    return workers;
+}
+
+// Counts each page with the dictionary that was current when FeedPages read it and
+// hands the page to on_page as soon as it is counted: in completion order, one
+// call at a time, so a long-running stream yields results without waiting for EOF.
+// Returns the number of pages read.
+template <typename Callback>
+size_t ExploreKeyWordsStreaming(const KeyWordsPublisher& publisher, istream& input, Callback on_page,
+    size_t worker_count = DefaultWorkerCount(), size_t page_size = 10000) {
+    worker_count = max<size_t>(worker_count, 1);
+    PageQueue queue(2 * worker_count);
+    mutex callback_mutex;
+    auto workers = StartPageWorkers(queue, worker_count, [&queue, &callback_mutex, &on_page](size_t) {
+        for (Page page; queue.Pop(page);) {
+            PageStats result = ExploreLinesVersioned(move(page.dictionary), move(page.lines));
+            result.sequence = page.sequence;
+            lock_guard<mutex> guard(callback_mutex);
+            on_page(move(result));
+        }
+    });
+    FeedResult feed;
+    {
+        PageQueueCloser closer(queue);
+        feed = FeedPages(input, queue, page_size, [] { return false; }, nullptr, &publisher);
+    }
+    for (auto& f : workers) {
+        f.get();
+    }
+    return feed.pages;
+}
+
+// Serves text in small chunks and calls trigger once, when reading first passes trigger_at
+class TriggerStreamBuf : public streambuf {
+public:
+    TriggerStreamBuf(string text, size_t trigger_at, function<void()> trigger)
+        : text_(move(text)), trigger_at_(trigger_at), trigger_(move(trigger)) {
+    }
+protected:
+    int_type underflow() override {
+        if (served_ >= trigger_at_ && trigger_) {
+            trigger_();
+            trigger_ = nullptr;
+        }
+        if (served_ == text_.size()) return traits_type::eof();
+        size_t chunk = min<size_t>(4096, text_.size() - served_);
+        char* begin = text_.data() + served_;
+        setg(begin, begin, begin + chunk);
+        served_ += chunk;
+        return traits_type::to_int_type(*begin);
+    }
+private:
+    string text_;
+    size_t served_ = 0;
+    size_t trigger_at_;
+    function<void()> trigger_;
+};
+
+void TestHotSwapKeyWords() {
+    const set<string> first = { "yangle", "rocks" };
+    const set<string> second = { "sucks", "Goondex" };
+    const int OPERATIONS = 30000;
+    const int PAGE_OPERATIONS = 10000 / 5;
+
+    const string text = MakeYangleText(OPERATIONS);
+
+    map<size_t, Stats> expected_page;
+    for (const auto& [version, key_words] : { make_pair(1u, first), make_pair(2u, second) }) {
+        stringstream page(MakeYangleText(PAGE_OPERATIONS));
+        expected_page[version] = ExploreKeyWords(key_words, page);
+    }
+
+    KeyWordsPublisher publisher(first);
+    {
+        size_t published = 0;
+        TriggerStreamBuf buf(text, text.size() / 2, [&publisher, &second, &published] {
+            published = publisher.Publish(second);
+        });
+        istream input(&buf);
+        vector<PageStats> pages;
+        const size_t page_count = ExploreKeyWordsStreaming(publisher, input, [&pages](PageStats page) {
+            pages.push_back(move(page));
+        });
+        sort(pages.begin(), pages.end(), [](const PageStats& lhs, const PageStats& rhs) {
+            return lhs.sequence < rhs.sequence;
+        });
+        ASSERT_EQUAL(published, 2u);
+        ASSERT_EQUAL(page_count, 15u);
+        ASSERT_EQUAL(pages.size(), 15u);
+        map<size_t, size_t> pages_by_version;
+        for (size_t i = 0; i < pages.size(); ++i) {
+            ASSERT(i == 0 || pages[i - 1].version <= pages[i].version);
+            ++pages_by_version[pages[i].version];
+            ASSERT_EQUAL(pages[i].stats.word_frequences, expected_page[pages[i].version].word_frequences);
+        }
+        ASSERT(pages_by_version[1] > 0);
+        ASSERT(pages_by_version[2] > 0);
+    }
+    {
+        stringstream ss(text);
+        size_t pages = 0;
+        ExploreKeyWordsStreaming(publisher, ss, [&pages](const PageStats& page) {
+            ASSERT_EQUAL(page.version, 2u);
+            ++pages;
+        }, 4, 1000);
+        ASSERT_EQUAL(pages, 150u);
+    }
+}
+
+template <typename Dictionary>
+ScanResult ScanWorker(ScanContext<Dictionary>& context, size_t worker) {
+    const auto& dictionary = context.dictionary;
+    ScanResult result;
+    if (!context.shared_counts && !context.sharded_counts) {
+        result.counts.resize(dictionary.Size());
+    }
+    auto& instrumentation = result.instrumentation;
+    unique_ptr<LineCache> cache;
+    if (context.options.line_cache_capacity > 0) {
+        cache = make_unique<LineCache>(context.options.line_cache_capacity);
+    }
+
+    if (context.options.cooccurrence) {
+        result.cooccurrence = CooccurrenceMatrix(dictionary.Size());
+    }
+    vector<size_t> line_ids;
+
+    auto count_hits = [&](const vector<size_t>& line_hits) {
+        if (context.shared_counts) {
+            for (size_t id : line_hits) context.shared_counts->Add(worker, id);
+        } else if (context.sharded_counts) {
+            for (size_t id : line_hits) context.sharded_counts->Add(id);
+        } else {
+            for (size_t id : line_hits) ++result.counts[id];
+        }
+        if (context.options.cooccurrence && !line_hits.empty()) {
+            line_ids = line_hits;
+            sort(line_ids.begin(), line_ids.end());
+            line_ids.erase(unique(line_ids.begin(), line_ids.end()), line_ids.end());
+            result.cooccurrence.AddLine(line_ids);
+        }
+        if (context.threshold.Active() && context.threshold.Add(line_hits)) {
+            context.queue.Cancel();
+        }
+    };
+
+    vector<size_t> hits;
+    for (Page page; context.queue.Pop(page);) {
+        if (context.Interrupted()) {
+            context.queue.Cancel();
+            break;
+        }
+        context.progress.PageStarted(worker);
+        size_t done = 0;
+        for (const auto& line : page.lines) {
+            if (context.Stopped()) break;
+            ++done;
+            ++instrumentation.lines;
+            result.coverage.bytes_completed += line.size() + 1;
+            size_t hash = 0;
+            if (cache) {
+                hash = std::hash<string>()(line);
+                if (const auto* cached = cache->Find(line, hash)) {
+                    ++instrumentation.cache_hits;
+                    count_hits(*cached);
+                    continue;
+                }
+                ++instrumentation.cache_misses;
+            }
+            hits.clear();
+            ForEachWord(line, [&](string_view word) {
+                ForEachDictionaryMatch(dictionary, word, [&](size_t id) {
+                    hits.push_back(id);
+                }, &instrumentation.prefilter);
+            });
+            count_hits(hits);
+            if (cache) {
+                cache->Store(line, hash, hits);
+            }
+        }
+        if (done == page.lines.size()) {
+            ++result.coverage.pages_completed;
+        }
+        context.progress.PageFinished(worker);
+    }
+    return result;
+}
+
+template <typename Dictionary>
+ScanResult ScanKeyWords(const Dictionary& dictionary, istream& input, const ScanOptions& options = {}) {
+    if (options.worker_count == 0) {
+        throw invalid_argument("ScanOptions::worker_count must be positive");
+    }
+    ScanContext<Dictionary> context(dictionary, options);
+    auto workers = StartPageWorkers(context.queue, options.worker_count, [&context](size_t worker) {
+        return ScanWorker(context, worker);
+    });
+    PageQueueCloser closer(context.queue);
+    ProgressMonitor monitor(context.progress, options);
+
+    ScanResult result;
+    result.counts.resize(dictionary.Size());
+    result.coverage.total_bytes = RemainingBytes(input);
+
+    const auto feed = FeedPages(input, context.queue, options.page_size,
+        [&context] { return context.Interrupted(); }, &context.progress);
+    context.queue.Close();
+
+    for (auto& f : workers) {
+        auto partial = f.get();
+        AddCounts(result.counts, partial.counts);
+        result.instrumentation += partial.instrumentation;
+        result.coverage.pages_completed += partial.coverage.pages_completed;
+        result.coverage.bytes_completed += partial.coverage.bytes_completed;
+        result.cooccurrence += partial.cooccurrence;
+    }
+    if (context.shared_counts) {
+        result.counts = context.shared_counts->Totals();
+    } else if (context.sharded_counts) {
+        result.counts = context.sharded_counts->Totals();
+    }
+    monitor.Finish();
+    result.threshold_reached = context.threshold.Reached();
+    result.cancelled = context.cancelled;
+    result.deadline_exceeded = context.deadline_exceeded;
+    result.coverage.complete = feed.reached_end && result.coverage.pages_completed == feed.pages;
+    return result;
+}
+
+// Counts on a fixed pool of workers with one counts vector each, merged once at the
+// end: with millions of keywords a vector per page would cost more than the dictionary
+template <typename Dictionary>
+vector<int> CountKeyWords(const Dictionary& dictionary, istream& input) {
+    return ScanKeyWords(dictionary, input).counts;
+}
+
+struct PartialStats {
+    Stats stats;
+    ScanCoverage coverage;
+};
+
+PartialStats ExploreKeyWords(const set<string>& key_words, istream& input,
+    const CancellationToken& cancellation, steady_clock::time_point deadline = steady_clock::time_point::max()) {
+    const KeyWordsDictionary dictionary(key_words);
+    ScanOptions options;
+    options.cancellation = &cancellation;
+    options.deadline = deadline;
+    auto result = ScanKeyWords(dictionary, input, options);
+    return { dictionary.ToStats(result.counts), result.coverage };
+}
+
+Stats ExploreKeyWords(const set<string>& key_words, istream& input, ScanOptions::Accumulation accumulation,
+    size_t worker_count = DefaultWorkerCount()) {
+    const KeyWordsDictionary dictionary(key_words);
+    ScanOptions options;
+    options.worker_count = max<size_t>(worker_count, 1);
+    options.accumulation = accumulation;
+    return dictionary.ToStats(ScanKeyWords(dictionary, input, options).counts);
+}
+
+void TestLineCache() {
+    const set<string> key_words = { "yangle", "rocks", "sucks", "all" };
+    const KeyWordsDictionary dictionary(key_words);
+    const int OPERATIONS = 30000;
+
+    string text = MakeYangleText(OPERATIONS);
+    const map<string, int> expected = {
+      {"yangle", 6 * OPERATIONS},
+      {"rocks", 2 * OPERATIONS},
+      {"sucks", OPERATIONS}
+    };
+
+    {
+        stringstream ss(text);
+        const auto result = ScanKeyWords(dictionary, ss);
+        ASSERT_EQUAL(dictionary.ToStats(result.counts).word_frequences, expected);
+        ASSERT_EQUAL(result.instrumentation.lines, 5u * OPERATIONS);
+        ASSERT_EQUAL(result.instrumentation.cache_hits + result.instrumentation.cache_misses, 0u);
+    }
+    {
+        ScanOptions options;
+        options.line_cache_capacity = 64;
+        stringstream ss(text);
+        const auto result = ScanKeyWords(dictionary, ss, options);
+        ASSERT_EQUAL(dictionary.ToStats(result.counts).word_frequences, expected);
+        ASSERT(result.instrumentation.CacheHitRate() > 0.99);
+    }
+    {
+        ScanOptions options;
+        options.line_cache_capacity = 1;
+        options.worker_count = 1;
+        stringstream ss(text);
+        const auto result = ScanKeyWords(dictionary, ss, options);
+        ASSERT_EQUAL(dictionary.ToStats(result.counts).word_frequences, expected);
+        ASSERT_EQUAL(result.instrumentation.cache_hits, 0u);
+    }
+    {
+        ScanOptions options;
+        options.worker_count = 0;
+        stringstream ss(text);
+        bool thrown = false;
+        try {
+            ScanKeyWords(dictionary, ss, options);
+        } catch (const invalid_argument&) {
+            thrown = true;
+        }
+        ASSERT(thrown);
+    }
+    {
+        stringstream ss(text);
+        ss.exceptions(ios::failbit);
+        bool thrown = false;
+        try {
+            ScanKeyWords(dictionary, ss);
+        } catch (const ios::failure&) {
+            thrown = true;
+        }
+        ASSERT(thrown);
+    }
+}
+
+void TestThresholdQueries() {
+    const set<string> key_words = { "yangle", "rocks", "sucks", "all" };
+    const KeyWordsDictionary dictionary(key_words);
+    const int OPERATIONS = 30000;
+
+    string text = MakeYangleText(OPERATIONS);
+    auto scan = [&](ThresholdQuery::Mode mode, int count) {
+        ScanOptions options;
+        options.page_size = 1000;
+        options.threshold = { mode, count };
+        stringstream ss(text);
+        return ScanKeyWords(dictionary, ss, options);
+    };
+    const size_t total_lines = 5 * OPERATIONS;
+
+    {
+        const auto result = scan(ThresholdQuery::Mode::AnyReaches, 100);
+        ASSERT(result.threshold_reached);
+        ASSERT(result.counts[dictionary.Find("yangle")] >= 100);
+        ASSERT(result.instrumentation.lines < total_lines);
+    }
+    {
+        const auto result = scan(ThresholdQuery::Mode::FirstMatches, 10);
+        ASSERT(result.threshold_reached);
+        ASSERT(accumulate(result.counts.begin(), result.counts.end(), 0) >= 10);
+        ASSERT(result.instrumentation.lines < total_lines);
+    }
+    {
+        const auto result = scan(ThresholdQuery::Mode::AllReach, 1);
+        ASSERT(!result.threshold_reached);
+        ASSERT_EQUAL(result.instrumentation.lines, total_lines);
+        ASSERT_EQUAL(result.counts[dictionary.Find("sucks")], OPERATIONS);
+    }
+    {
+        const KeyWordsDictionary present({ "yangle", "rocks", "sucks" });
+        ScanOptions options;
+        options.page_size = 1000;
+        options.threshold = { ThresholdQuery::Mode::AllReach, 50 };
+        stringstream ss(text);
+        const auto result = ScanKeyWords(present, ss, options);
+        ASSERT(result.threshold_reached);
+        for (int count : result.counts) {
+            ASSERT(count >= 50);
+        }
+        ASSERT(result.instrumentation.lines < total_lines);
+    }
+}
+
+void TestCancellation() {
+    const set<string> key_words = { "yangle", "rocks", "sucks", "all" };
+    const int OPERATIONS = 30000;
+
+    string text = MakeYangleText(OPERATIONS);
+
+    {
+        CancellationToken token;
+        stringstream ss(text);
+        const auto result = ExploreKeyWords(key_words, ss, token);
+        ASSERT(result.coverage.complete);
+        ASSERT_EQUAL(result.coverage.Fraction().value(), 1.0);
+        ASSERT_EQUAL(result.coverage.total_bytes.value(), text.size());
+        ASSERT_EQUAL(result.stats.word_frequences.at("yangle"), 6 * OPERATIONS);
+    }
+    {
+        CancellationToken token;
+        token.Cancel();
+        stringstream ss(text);
+        const auto result = ExploreKeyWords(key_words, ss, token);
+        ASSERT(!result.coverage.complete);
+        ASSERT_EQUAL(result.coverage.pages_completed, 0u);
+        ASSERT(result.stats.word_frequences.empty());
+    }
+    {
+        CancellationToken token;
+        stringstream ss(text);
+        const auto result = ExploreKeyWords(key_words, ss, token, steady_clock::now() - 1ms);
+        ASSERT(!result.coverage.complete);
+        ASSERT(result.stats.word_frequences.empty());
+    }
+    {
+        CancellationToken token;
+        TriggerStreamBuf buf(text, text.size() / 3, [&token] { token.Cancel(); });
+        istream input(&buf);
+        const KeyWordsDictionary dictionary(key_words);
+        ScanOptions options;
+        options.page_size = 1000;
+        options.cancellation = &token;
+        const auto result = ScanKeyWords(dictionary, input, options);
+        ASSERT(result.cancelled);
+        ASSERT(!result.coverage.complete);
+        ASSERT(!result.coverage.Fraction().has_value());
+        ASSERT(result.coverage.pages_completed > 0);
+        ASSERT(result.coverage.bytes_completed < text.size());
+        const int page_operations = 1000 / 5;
+        ASSERT_EQUAL(result.counts[dictionary.Find("yangle")],
+            6 * page_operations * static_cast<int>(result.coverage.pages_completed));
+    }
+}
+
+void TestProgressReports() {
+    const set<string> key_words = { "yangle", "rocks", "sucks", "all" };
+    const KeyWordsDictionary dictionary(key_words);
+    const int OPERATIONS = 30000;
+
+    string text = MakeYangleText(OPERATIONS);
+
+    vector<ScanProgress> reports;
+    ScanOptions options;
+    options.page_size = 1000;
+    options.progress_interval = 1ms;
+    options.on_progress = [&reports](const ScanProgress& progress) {
+        reports.push_back(progress);
+    };
+    stringstream ss(text);
+    const auto result = ScanKeyWords(dictionary, ss, options);
+    ASSERT(result.coverage.complete);
+
+    ASSERT(!reports.empty());
+    for (size_t i = 1; i < reports.size(); ++i) {
+        ASSERT(reports[i - 1].bytes_read <= reports[i].bytes_read);
+        ASSERT(reports[i - 1].pages_completed <= reports[i].pages_completed);
+    }
+    for (const auto& report : reports) {
+        ASSERT_EQUAL(report.worker_utilization.size(), options.worker_count);
+        for (double utilization : report.worker_utilization) {
+            ASSERT(utilization >= 0.0 && utilization <= 1.0);
+        }
+    }
+    const auto& last = reports.back();
+    ASSERT_EQUAL(last.bytes_read, text.size());
+    ASSERT_EQUAL(last.lines_read, 5u * OPERATIONS);
+    ASSERT_EQUAL(last.pages_completed, 5u * OPERATIONS / 1000);
+    ASSERT_EQUAL(last.pages_in_flight, 0u);
+}
+
+void WriteVarint(ostream& output, uint64_t value) {
+    while (value >= 0x80) {
+        output.put(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    output.put(static_cast<char>(value));
+}
+
+uint64_t ReadVarint(istream& input) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = input.get();
+        if (byte == char_traits<char>::eof()) {
+            throw runtime_error("truncated serialized stats");
+        }
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) return value;
+    }
+    throw runtime_error("malformed varint in serialized stats");
+}
+
+// Layout: "KWS1", 8-byte little-endian dictionary fingerprint,
+// varint keyword count, then one varint count per keyword id
+const string STATS_MAGIC = "KWS1";
+
+struct SerializedStatsHeader {
+    uint64_t fingerprint = 0;
+    uint64_t keyword_count = 0;
+};
+
+void WriteStatsHeader(ostream& output, const SerializedStatsHeader& header) {
+    output.write(STATS_MAGIC.data(), STATS_MAGIC.size());
+    for (int i = 0; i < 8; ++i) {
+        output.put(static_cast<char>(header.fingerprint >> (8 * i)));
+    }
+    WriteVarint(output, header.keyword_count);
+}
+
+SerializedStatsHeader ReadStatsHeader(istream& input) {
+    string magic(STATS_MAGIC.size(), '\0');
+    if (!input.read(magic.data(), magic.size()) || magic != STATS_MAGIC) {
+        throw runtime_error("not a serialized stats stream");
+    }
+    SerializedStatsHeader header;
+    for (int i = 0; i < 8; ++i) {
+        int byte = input.get();
+        if (byte == char_traits<char>::eof()) {
+            throw runtime_error("truncated serialized stats");
+        }
+        header.fingerprint |= static_cast<uint64_t>(byte) << (8 * i);
+    }
+    header.keyword_count = ReadVarint(input);
+    return header;
+}
+
+void SerializeCounts(const KeyWordsDictionary& dictionary, const vector<int>& counts, ostream& output) {
+    WriteStatsHeader(output, { dictionary.Fingerprint(), dictionary.Size() });
+    for (size_t id = 0; id < dictionary.Size(); ++id) {
+        WriteVarint(output, id < counts.size() ? counts[id] : 0);
+    }
+}
+
+void SerializeStats(const KeyWordsDictionary& dictionary, const Stats& stats, ostream& output) {
+    // Find only knows exact keywords, while Stats may also hold pattern texts
+    unordered_map<string_view, size_t> ids;
+    ids.reserve(dictionary.Size());
+    for (size_t id = 0; id < dictionary.Size(); ++id) {
+        ids[dictionary.Word(id)] = id;
+    }
+    vector<int> counts(dictionary.Size());
+    for (const auto& [word, count] : stats.word_frequences) {
+        auto it = ids.find(word);
+        if (it == ids.end()) {
+            throw invalid_argument("word " + word + " is not in the dictionary");
+        }
+        counts[it->second] = count;
+    }
+    SerializeCounts(dictionary, counts, output);
+}
+
+Stats DeserializeStats(const KeyWordsDictionary& dictionary, istream& input) {
+    const auto header = ReadStatsHeader(input);
+    if (header.fingerprint != dictionary.Fingerprint() || header.keyword_count != dictionary.Size()) {
+        throw runtime_error("serialized stats were built with another dictionary");
+    }
+    vector<int> counts(dictionary.Size());
+    for (auto& count : counts) {
+        count = static_cast<int>(ReadVarint(input));
+    }
+    return dictionary.ToStats(counts);
+}
+
+// Streams k partial results into one without materializing any of them
+void MergeSerializedStats(const vector<istream*>& inputs, ostream& output) {
+    if (inputs.empty()) {
+        throw invalid_argument("nothing to merge");
+    }
+    const auto header = ReadStatsHeader(*inputs.front());
+    for (size_t i = 1; i < inputs.size(); ++i) {
+        const auto other = ReadStatsHeader(*inputs[i]);
+        if (other.fingerprint != header.fingerprint || other.keyword_count != header.keyword_count) {
+            throw runtime_error("cannot merge stats built with different dictionaries");
+        }
+    }
+    WriteStatsHeader(output, header);
+    for (uint64_t id = 0; id < header.keyword_count; ++id) {
+        uint64_t sum = 0;
+        for (auto* input : inputs) {
+            sum += ReadVarint(*input);
+        }
+        WriteVarint(output, sum);
+    }
+}
+
+void TestStatsSerialization() {
+    const set<string> key_words = { "yangle", "rocks", "sucks", "all" };
+    const KeyWordsDictionary dictionary(key_words);
+    const int OPERATIONS = 3000;
+    const size_t PARTS = 3;
+
+    vector<string> parts(PARTS);
+    string text;
+    for (int i = 0; i < OPERATIONS; ++i) {
+        const string block = MakeYangleText(1);
+        parts[i % PARTS] += block;
+        text += block;
+    }
+
+    vector<stringstream> serialized(PARTS);
+    for (size_t i = 0; i < PARTS; ++i) {
+        stringstream part(parts[i]);
+        SerializeCounts(dictionary, ScanKeyWords(dictionary, part).counts, serialized[i]);
+    }
+    ASSERT(serialized[0].str().size() < 32);
+
+    vector<istream*> inputs;
+    for (auto& stream : serialized) inputs.push_back(&stream);
+    stringstream merged;
+    MergeSerializedStats(inputs, merged);
+
+    stringstream whole(text);
+    ASSERT_EQUAL(DeserializeStats(dictionary, merged).word_frequences,
+        ExploreKeyWords(key_words, whole).word_frequences);
+
+    stringstream round_trip;
+    const Stats stats{ { { "rocks", 300 }, { "yangle", 1 } } };
+    SerializeStats(dictionary, stats, round_trip);
+    ASSERT_EQUAL(DeserializeStats(dictionary, round_trip).word_frequences, stats.word_frequences);
+
+    using Kind = KeyWordPattern::Kind;
+    const vector<KeyWordPattern> patterns = { { Kind::Glob, "err*" }, { Kind::Regex, "user_[0-9]+" } };
+    const KeyWordsDictionary with_patterns(key_words, patterns);
+    stringstream pattern_input("error yangle user_12 errno\nuser_7 rocks\n");
+    const Stats pattern_stats = ExploreKeyWords(key_words, patterns, pattern_input);
+    ASSERT_EQUAL(pattern_stats.word_frequences.at("err*"), 2);
+    stringstream pattern_round_trip;
+    SerializeStats(with_patterns, pattern_stats, pattern_round_trip);
+    ASSERT_EQUAL(DeserializeStats(with_patterns, pattern_round_trip).word_frequences, pattern_stats.word_frequences);
+
+    const KeyWordsDictionary other({ "yangle", "rocks" });
+    stringstream foreign;
+    SerializeStats(other, stats, foreign);
+    bool thrown = false;
+    try {
+        DeserializeStats(dictionary, foreign);
+    } catch (runtime_error&) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+}
+
+// Serves at most `limit` bytes of the underlying stream
+class BoundedStreamBuf : public streambuf {
+public:
+    BoundedStreamBuf(istream& input, size_t limit)
+        : input_(input), remaining_(limit), buffer_(1 << 16) {
+    }
+protected:
+    int_type underflow() override {
+        if (remaining_ == 0) return traits_type::eof();
+        input_.read(buffer_.data(), min(buffer_.size(), remaining_));
+        size_t got = static_cast<size_t>(input_.gcount());
+        if (got == 0) return traits_type::eof();
+        remaining_ -= got;
+        setg(buffer_.data(), buffer_.data(), buffer_.data() + got);
+        return traits_type::to_int_type(buffer_[0]);
+    }
+private:
+    istream& input_;
+    size_t remaining_;
+    vector<char> buffer_;
+};
+
+// Offsets splitting the file into `shards` byte ranges that start at line beginnings
+vector<size_t> LineAlignedShards(const string& path, size_t shards) {
+    ifstream input(path, ios::binary);
+    if (!input) {
+        throw runtime_error("cannot open " + path);
+    }
+    input.seekg(0, ios::end);
+    const size_t size = static_cast<size_t>(input.tellg());
+
+    vector<size_t> bounds = { 0 };
+    for (size_t i = 1; i < shards; ++i) {
+        size_t offset = max(bounds.back(), size * i / shards);
+        if (offset > 0 && offset < size) {
+            input.seekg(offset - 1);
+            if (input.get() != '\n') {
+                string rest;
+                getline(input, rest);
+                offset = input ? static_cast<size_t>(input.tellg()) : size;
+                input.clear();
+            }
+        }
+        bounds.push_back(min(offset, size));
+    }
+    bounds.push_back(size);
+    return bounds;
+}
+
+vector<int> CountFileRange(const KeyWordsDictionary& dictionary, const string& path,
+    size_t begin, size_t end, const ScanOptions& options) {
+    ifstream input(path, ios::binary);
+    input.seekg(begin);
+    BoundedStreamBuf buffer(input, end - begin);
+    istream range(&buffer);
+    return ScanKeyWords(dictionary, range, options).counts;
+}
+
+// Each child process scans one shard and writes its dense counts into its own row
+// of an anonymous shared mapping; the parent sums the rows after waiting for all children.
+// The children start threads and allocate right after fork(), which is only safe while
+// the caller has no other threads: call it before the program starts any. Each child
+// runs options.worker_count workers.
+vector<int> ScanFileInProcesses(const KeyWordsDictionary& dictionary, const string& path,
+    size_t process_count, const ScanOptions& options) {
+    const auto bounds = LineAlignedShards(path, max<size_t>(process_count, 1));
+    const size_t shards = bounds.size() - 1;
+    const size_t row = dictionary.Size();
+    vector<int> counts(row);
+
+#if defined(__unix__) || defined(__APPLE__)
+    const size_t bytes = max<size_t>(shards * row * sizeof(int64_t), 1);
+    void* segment = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (segment == MAP_FAILED) {
+        throw runtime_error("cannot map shared counters");
+    }
+    auto* shared = static_cast<int64_t*>(segment);
+
+    cout.flush();
+    cerr.flush();
+    vector<pid_t> children;
+    for (size_t shard = 0; shard < shards; ++shard) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            int status = 0;
+            try {
+                const auto local = CountFileRange(dictionary, path, bounds[shard], bounds[shard + 1], options);
+                copy(local.begin(), local.end(), shared + shard * row);
+            } catch (...) {
+                status = 1;
+            }
+            _exit(status);
+        }
+        if (pid < 0) break;
+        children.push_back(pid);
+    }
+
+    bool failed = children.size() != shards;
+    for (pid_t child : children) {
+        int status = 0;
+        if (waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed = true;
+        }
+    }
+    if (!failed) {
+        for (size_t shard = 0; shard < shards; ++shard) {
+            for (size_t id = 0; id < row; ++id) {
+                counts[id] += static_cast<int>(shared[shard * row + id]);
+            }
+        }
+    }
+    munmap(segment, bytes);
+    if (failed) {
+        throw runtime_error("a shard process failed while scanning " + path);
+    }
+#else
+    for (size_t shard = 0; shard < shards; ++shard) {
+        AddCounts(counts, CountFileRange(dictionary, path, bounds[shard], bounds[shard + 1], options));
+    }
+#endif
+    return counts;
+}
+
+// Splits the cores between the processes, so that they run one worker per core in total
+vector<int> ScanFileInProcesses(const KeyWordsDictionary& dictionary, const string& path, size_t process_count) {
+    ScanOptions options;
+    options.worker_count = max<size_t>(1, DefaultWorkerCount() / max<size_t>(process_count, 1));
+    return ScanFileInProcesses(dictionary, path, process_count, options);
+}
+
+void TestProcessShards() {
+    const set<string> key_words = { "yangle", "rocks", "sucks", "all" };
+    const KeyWordsDictionary dictionary(key_words);
+    const int OPERATIONS = 30000;
+    const string path = (filesystem::temp_directory_path() / "explore_key_words_shards.txt").string();
+
+    string text = MakeYangleText(OPERATIONS);
+    ofstream(path, ios::binary) << text;
+
+    ScanOptions options;
+    options.worker_count = 1;
+    for (size_t processes : { 1, 3, 4 }) {
+        const auto counts = ScanFileInProcesses(dictionary, path, processes, options);
+        const map<string, int> expected = {
+          {"yangle", 6 * OPERATIONS},
+          {"rocks", 2 * OPERATIONS},
+          {"sucks", OPERATIONS}
+        };
+        AssertEqual(dictionary.ToStats(counts).word_frequences, expected,
+            "processes = " + to_string(processes));
+    }
+
+    ofstream(path, ios::binary) << "yangle\nrocks yangle";
+    const auto counts = ScanFileInProcesses(dictionary, path, 8, options);
+    ASSERT_EQUAL(dictionary.ToStats(counts).word_frequences, (map<string, int>{ {"rocks", 1}, {"yangle", 2} }));
+    const auto split_counts = ScanFileInProcesses(dictionary, path, 2);
+    ASSERT_EQUAL(dictionary.ToStats(split_counts).word_frequences, (map<string, int>{ {"rocks", 1}, {"yangle", 2} }));
+    filesystem::remove(path);
+}
+
+void TestCooccurrence() {
+    const set<string> key_words = { "yangle", "rocks", "sucks", "all" };
+    const KeyWordsDictionary dictionary(key_words);
+    const int OPERATIONS = 3000;
+
+    string text = MakeYangleText(OPERATIONS);
+
+    ScanOptions options;
+    options.page_size = 1000;
+    options.cooccurrence = true;
+    stringstream ss(text);
+    const auto result = ScanKeyWords(dictionary, ss, options);
+    const auto& matrix = result.cooccurrence;
+    ASSERT(matrix.IsDense());
+
+    const auto pairs = matrix.ToPairs(dictionary);
+    ASSERT_EQUAL(pairs.size(), 2u);
+    ASSERT_EQUAL(pairs.at({ "rocks", "yangle" }), 2 * OPERATIONS);
+    ASSERT_EQUAL(pairs.at({ "sucks", "yangle" }), OPERATIONS);
+    const size_t yangle = dictionary.Find("yangle");
+    ASSERT_EQUAL(matrix.Get(yangle, yangle), 5 * OPERATIONS);
+    ASSERT_EQUAL(result.counts[yangle], 6 * OPERATIONS);
+
+    CooccurrenceMatrix dense(4);
+    CooccurrenceMatrix sparse(4, 2);
+    ASSERT(dense.IsDense());
+    ASSERT_EQUAL(dense.Get(1, 3), 0);
+    ASSERT(!sparse.IsDense());
+    for (const vector<size_t>& line : { vector<size_t>{ 0, 3 }, { 1, 2, 3 }, { 3 } }) {
+        dense.AddLine(line);
+        sparse.AddLine(line);
+    }
+    CooccurrenceMatrix merged(4, 2);
+    merged += sparse;
+    merged += sparse;
+    for (size_t a = 0; a < 4; ++a) {
+        for (size_t b = 0; b < 4; ++b) {
+            ASSERT_EQUAL(sparse.Get(a, b), dense.Get(b, a));
+            ASSERT_EQUAL(merged.Get(a, b), 2 * dense.Get(a, b));
+        }
+    }
+    ASSERT_EQUAL(dense.Get(3, 3), 3);
+    ASSERT_EQUAL(dense.Get(2, 3), 1);
+    const auto dense_pairs = dense.ToPairs(dictionary);
+    ASSERT_EQUAL(dense_pairs.size(), 4u);
+    ASSERT(sparse.ToPairs(dictionary) == dense_pairs);
+
+    // Sparse ToPairs touches only the recorded pairs, not all K^2 / 2 of them
+    set<string> many_words;
+    for (int i = 0; i < 200000; ++i) {
+        many_words.insert("w" + to_string(i));
+    }
+    const KeyWordsDictionary large(many_words);
+    CooccurrenceMatrix large_sparse(large.Size());
+    ASSERT(!large_sparse.IsDense());
+    large_sparse.AddLine({ 5, 199999 });
+    large_sparse.AddLine({ 123456, 199998, 199999 });
+    {
+        LOG_DURATION("Sparse co-occurrence pairs, 200000 keywords: ");
+        const auto large_pairs = large_sparse.ToPairs(large);
+        ASSERT_EQUAL(large_pairs.size(), 4u);
+        const auto pair = minmax(large.Word(199998), large.Word(199999));
+        ASSERT_EQUAL(large_pairs.at(pair), 1);
+    }
+}
+
+struct NgramCount {
+    string text;
+    int count = 0;
+};
+
+bool operator == (const NgramCount& lhs, const NgramCount& rhs) {
+    return lhs.text == rhs.text && lhs.count == rhs.count;
+}
+
+ostream& operator << (ostream& os, const NgramCount& ngram) {
+    return os << ngram.text << ": " << ngram.count;
+}
+
+// Keyed by a 64-bit rolling hash of the window; the text is kept from the first occurrence
+using NgramTable = unordered_map<uint64_t, NgramCount>;
+
+void AccumulateNgrams(size_t n, const vector<string>& input, NgramTable& result) {
+    const uint64_t BASE = 1000003;
+    uint64_t base_power = 1;
+    for (size_t i = 1; i < n; ++i) base_power *= BASE;
+
+    vector<string_view> window(n);
+    vector<uint64_t> window_hashes(n);
+    for (const auto& line : input) {
+        size_t seen = 0;
+        uint64_t hash = 0;
+        ForEachWord(line, [&](string_view word) {
+            const size_t slot = seen % n;
+            const uint64_t word_hash = std::hash<string_view>()(word);
+            if (seen >= n) {
+                hash -= window_hashes[slot] * base_power;
+            }
+            hash = hash * BASE + word_hash;
+            window[slot] = word;
+            window_hashes[slot] = word_hash;
+            if (++seen < n) return;
+
+            auto& entry = result[hash];
+            if (entry.count++ == 0) {
+                for (size_t i = 0; i < n; ++i) {
+                    if (i > 0) entry.text += ' ';
+                    entry.text += window[(seen + i) % n];
+                }
+            }
+        });
+    }
+}
+
+// The `top` most frequent runs of n consecutive words within a line. Workers key their
+// tables by rolling hash; the tables are summed by hash and only then ranked.
+vector<NgramCount> ExploreNgrams(istream& input, size_t n, size_t top,
+    size_t worker_count = DefaultWorkerCount(), size_t page_size = 10000) {
+    if (n == 0) {
+        throw invalid_argument("n-gram length must be positive");
+    }
+    worker_count = max<size_t>(worker_count, 1);
+    PageQueue queue(2 * worker_count);
+    auto workers = StartPageWorkers(queue, worker_count, [&queue, n](size_t) {
+        NgramTable table;
+        for (Page page; queue.Pop(page);) {
+            AccumulateNgrams(n, page.lines, table);
+        }
+        return table;
+    });
+    {
+        PageQueueCloser closer(queue);
+        FeedPages(input, queue, page_size, [] { return false; });
+    }
+
+    NgramTable merged;
+    for (auto& f : workers) {
+        for (auto& [hash, ngram] : f.get()) {
+            auto& entry = merged[hash];
+            if (entry.count == 0) entry.text = move(ngram.text);
+            entry.count += ngram.count;
+        }
+    }
+
+    vector<NgramCount> result;
+    result.reserve(merged.size());
+    for (auto& [hash, ngram] : merged) {
+        result.push_back(move(ngram));
+    }
+    auto by_frequency = [](const NgramCount& lhs, const NgramCount& rhs) {
+        if (lhs.count != rhs.count) return lhs.count > rhs.count;
+        return lhs.text < rhs.text;
+    };
+    top = min(top, result.size());
+    partial_sort(result.begin(), result.begin() + top, result.end(), by_frequency);
+    result.resize(top);
+    return result;
+}
+
+void TestNgrams() {
+    const int OPERATIONS = 3000;
+    string text;
+    for (int i = 0; i < OPERATIONS; ++i) {
+        text += MakeYangleText(1);
+        text += to_string(i % 7) + " yangle rocks\n";
+    }
+
+    for (size_t n : { 1, 2, 3 }) {
+        map<string, int> naive;
+        istringstream lines(text);
+        for (string line; getline(lines, line);) {
+            istringstream words(line);
+            vector<string> tokens{ istream_iterator<string>(words), istream_iterator<string>() };
+            for (size_t i = 0; i + n <= tokens.size(); ++i) {
+                string ngram = tokens[i];
+                for (size_t j = 1; j < n; ++j) ngram += " " + tokens[i + j];
+                ++naive[ngram];
+            }
+        }
+        vector<NgramCount> expected;
+        for (const auto& [ngram, count] : naive) expected.push_back({ ngram, count });
+        stable_sort(expected.begin(), expected.end(), [](const NgramCount& lhs, const NgramCount& rhs) {
+            return lhs.count > rhs.count;
+        });
+        expected.resize(5);
+
+        for (size_t workers : { 1, 4 }) {
+            stringstream ss(text);
+            AssertEqual(ExploreNgrams(ss, n, 5, workers, 1000), expected,
+                "n = " + to_string(n) + ", workers = " + to_string(workers));
+        }
+    }
+
+    stringstream ss(text);
+    const auto bigrams = ExploreNgrams(ss, 2, 1);
+    ASSERT_EQUAL(bigrams, vector<NgramCount>({ { "yangle rocks", 2 * OPERATIONS } }));
+}
+
+struct SamplingOptions {
+    double fraction = 0.1;
+    size_t chunk_bytes = 1 << 20;
+    double z_score = 1.96;
+    unsigned seed = 0;
+    size_t worker_count = DefaultWorkerCount();
+};
+
+struct EstimatedCount {
+    double estimate = 0;
+    double low = 0;
+    double high = 0;
+};
+
+struct SampledStats {
+    map<string, EstimatedCount> word_frequences;
+    size_t chunks_total = 0;
+    size_t chunks_sampled = 0;
+};
+
+vector<int> CountFileRangeSequential(const KeyWordsDictionary& dictionary, const string& path,
+    size_t begin, size_t end) {
+    ifstream input(path, ios::binary);
+    input.seekg(begin);
+    BoundedStreamBuf buffer(input, end - begin);
+    istream range(&buffer);
+    vector<int> counts(dictionary.Size());
+    const size_t PAGE_SIZE = 10000;
+    for (auto strings = FetchMore(PAGE_SIZE, range); !strings.empty(); strings = FetchMore(PAGE_SIZE, range)) {
+        AddCounts(counts, CountLinesVector(dictionary, move(strings)));
+    }
+    return counts;
+}
+
+// Counts a simple random sample of equal-sized chunks and scales it up to the
+// whole file; the interval uses the sample variance with finite population correction
+SampledStats ExploreKeyWordsSampled(const KeyWordsDictionary& dictionary, const string& path,
+    const SamplingOptions& options = {}) {
+    if (options.chunk_bytes == 0) {
+        throw invalid_argument("SamplingOptions::chunk_bytes must be positive");
+    }
+    ifstream probe(path, ios::binary | ios::ate);
+    if (!probe) {
+        throw runtime_error("cannot open " + path);
+    }
+    const size_t size = static_cast<size_t>(probe.tellg());
+    const size_t chunk_count = max<size_t>(1, (size + options.chunk_bytes - 1) / options.chunk_bytes);
+    const auto bounds = LineAlignedShards(path, chunk_count);
+
+    vector<size_t> chunks(chunk_count);
+    iota(chunks.begin(), chunks.end(), 0);
+    shuffle(chunks.begin(), chunks.end(), mt19937(options.seed));
+    const size_t sampled = clamp<size_t>(static_cast<size_t>(ceil(options.fraction * chunk_count)), 1, chunk_count);
+    chunks.resize(sampled);
+
+    vector<vector<int>> chunk_counts(sampled);
+    atomic<size_t> next{ 0 };
+    vector<future<void>> workers;
+    for (size_t i = 0; i < max<size_t>(options.worker_count, 1); ++i) {
+        workers.push_back(async(launch::async, [&] {
+            for (size_t k; (k = next.fetch_add(1)) < sampled;) {
+                chunk_counts[k] = CountFileRangeSequential(dictionary, path, bounds[chunks[k]], bounds[chunks[k] + 1]);
+            }
+        }));
+    }
+    for (auto& f : workers) {
+        f.get();
+    }
+
+    SampledStats result;
+    result.chunks_total = chunk_count;
+    result.chunks_sampled = sampled;
+    const double population = static_cast<double>(chunk_count);
+    const double m = static_cast<double>(sampled);
+    for (size_t id = 0; id < dictionary.Size(); ++id) {
+        double sum = 0;
+        double sum_squares = 0;
+        for (const auto& counts : chunk_counts) {
+            sum += counts[id];
+            sum_squares += static_cast<double>(counts[id]) * counts[id];
+        }
+        if (sum == 0) continue;
+        const double mean = sum / m;
+        const double sample_variance = sampled > 1 ? (sum_squares - m * mean * mean) / (m - 1) : 0.0;
+        const double variance = population * population * (1 - m / population) * max(sample_variance, 0.0) / m;
+        const double estimate = population * mean;
+        const double margin = options.z_score * sqrt(variance);
+        result.word_frequences[dictionary.Word(id)] = { estimate, max(estimate - margin, 0.0), estimate + margin };
+    }
+    return result;
+}
+
+void TestSampledScan() {
+    const set<string> key_words = { "yangle", "rocks", "sucks", "all" };
+    const KeyWordsDictionary dictionary(key_words);
+    const int OPERATIONS = 30000;
+    const string path = (filesystem::temp_directory_path() / "explore_key_words_sampled.txt").string();
+
+    string text = MakeYangleText(OPERATIONS);
+    ofstream(path, ios::binary) << text;
+
+    SamplingOptions options;
+    options.chunk_bytes = 4096;
+    options.fraction = 1.0;
+    const auto full = ExploreKeyWordsSampled(dictionary, path, options);
+    ASSERT_EQUAL(full.chunks_sampled, full.chunks_total);
+    ASSERT_EQUAL(full.word_frequences.at("yangle").estimate, 6.0 * OPERATIONS);
+    ASSERT_EQUAL(full.word_frequences.at("yangle").low, full.word_frequences.at("yangle").high);
+
+    options.fraction = 0.2;
+    for (unsigned seed : { 1u, 2u, 3u }) {
+        options.seed = seed;
+        const auto sampled = ExploreKeyWordsSampled(dictionary, path, options);
+        ASSERT(sampled.chunks_sampled < sampled.chunks_total);
+        for (const auto& [word, truth] : { make_pair("yangle", 6.0 * OPERATIONS), make_pair("sucks", 1.0 * OPERATIONS) }) {
+            const auto& estimate = sampled.word_frequences.at(word);
+            ASSERT(abs(estimate.estimate - truth) < 0.02 * truth);
+            ASSERT(estimate.low <= estimate.estimate && estimate.estimate <= estimate.high);
+        }
+    }
+
+    options.chunk_bytes = 0;
+    bool thrown = false;
+    try {
+        ExploreKeyWordsSampled(dictionary, path, options);
+    } catch (const invalid_argument&) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+    filesystem::remove(path);
+}
+
+void TestBloomPrefilter() {
+    const size_t KEY_WORDS = 60000;
+    set<string> key_words;
+    for (size_t i = 0; i < KEY_WORDS; ++i) {
+        key_words.insert("entity" + to_string(i * 7));
+    }
+    const KeyWordsDictionary plain(key_words);
+    KeyWordsDictionary filtered(key_words);
+    filtered.BuildPrefilter();
+    ASSERT(!plain.HasPrefilter());
+    ASSERT(filtered.HasPrefilter());
+
+    mt19937 generator(42);
+    string text;
+    size_t tokens = 0;
+    for (int line = 0; line < 20000; ++line) {
+        for (int word = 0; word < 10; ++word, ++tokens) {
+            text += "entity" + to_string(generator() % (KEY_WORDS * 70)) + " ";
+        }
+        text += "\n";
+    }
+
+    ScanResult plain_result;
+    ScanResult filtered_result;
+    {
+        LOG_DURATION("Dictionary lookup without prefilter");
+        stringstream ss(text);
+        plain_result = ScanKeyWords(plain, ss);
+    }
+    {
+        LOG_DURATION("Dictionary lookup with Bloom prefilter");
+        stringstream ss(text);
+        filtered_result = ScanKeyWords(filtered, ss);
+    }
+    ASSERT_EQUAL(plain_result.counts, filtered_result.counts);
+    stringstream ss(text);
+    ASSERT_EQUAL(filtered.ToStats(filtered_result.counts).word_frequences,
+        ExploreKeyWords(key_words, ss).word_frequences);
+
+    const auto& counters = filtered_result.instrumentation.prefilter;
+    ASSERT_EQUAL(counters.rejected + counters.hits + counters.false_positives, tokens);
+    ASSERT_EQUAL(counters.hits,
+        static_cast<size_t>(accumulate(filtered_result.counts.begin(), filtered_result.counts.end(), 0)));
+    ASSERT(counters.FalsePositiveRate() < 0.05);
+    ASSERT_EQUAL(plain_result.instrumentation.prefilter.rejected, 0u);
+}
+
+void AppendVarint(string& output, uint64_t value) {
+    while (value >= 0x80) {
+        output += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    output += static_cast<char>(value);
+}
+
+uint64_t ReadVarint(const char*& pos) {
+    uint64_t value = 0;
+    for (int shift = 0;; shift += 7) {
+        uint8_t byte = static_cast<uint8_t>(*pos++);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) return value;
+    }
+}
+
+// Sorted keywords, front-coded in blocks of BLOCK_SIZE: the first key of a block
+// is stored whole, the rest as (shared prefix length, suffix). The image is one
+// flat byte range -- "KWFC0001", keyword count, block count, block offsets, blob --
+// so it can be written once and mapped back read-only. A keyword's id is its rank.
+class CompactKeyWordsDictionary {
+public:
+    static constexpr size_t NPOS = KeyWordsDictionary::NPOS;
+    static constexpr size_t BLOCK_SIZE = 16;
+
+    static string BuildImage(const set<string>& key_words) {
+        string blob;
+        vector<uint64_t> offsets;
+        const string* previous = nullptr;
+        size_t index = 0;
+        for (const auto& word : key_words) {
+            if (index++ % BLOCK_SIZE == 0) {
+                offsets.push_back(blob.size());
+                AppendVarint(blob, word.size());
+                blob += word;
+            } else {
+                size_t shared = mismatch(previous->begin(), previous->end(), word.begin(), word.end()).first - previous->begin();
+                AppendVarint(blob, shared);
+                AppendVarint(blob, word.size() - shared);
+                blob.append(word, shared, string::npos);
+            }
+            previous = &word;
+        }
+
+        string image(MAGIC);
+        AppendWord(image, key_words.size());
+        AppendWord(image, offsets.size());
+        for (uint64_t offset : offsets) AppendWord(image, offset);
+        return image + blob;
+    }
+
+    explicit CompactKeyWordsDictionary(const set<string>& key_words) {
+        auto image = make_shared<string>(BuildImage(key_words));
+        Attach(string_view(*image), image);
+    }
+
+    static CompactKeyWordsDictionary Load(const string& path) {
+#if defined(__unix__) || defined(__APPLE__)
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw runtime_error("cannot open " + path);
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            close(fd);
+            throw runtime_error("cannot map " + path);
+        }
+        const size_t size = static_cast<size_t>(info.st_size);
+        void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            throw runtime_error("cannot map " + path);
+        }
+        shared_ptr<const void> owner(mapping, [size](const void* address) {
+            munmap(const_cast<void*>(address), size);
+        });
+        return CompactKeyWordsDictionary(string_view(static_cast<const char*>(mapping), size), move(owner));
+#else
+        ifstream input(path, ios::binary);
+        if (!input) {
+            throw runtime_error("cannot open " + path);
+        }
+        auto image = make_shared<string>(istreambuf_iterator<char>(input), istreambuf_iterator<char>());
+        return CompactKeyWordsDictionary(string_view(*image), image);
+#endif
+    }
+
+    void Save(const string& path) const {
+        ofstream output(path, ios::binary);
+        output.write(image_.data(), image_.size());
+        if (!output) {
+            throw runtime_error("cannot write " + path);
+        }
+    }
+
+    size_t Find(string_view word) const {
+        if (block_count_ == 0) return NPOS;
+        size_t lo = 0;
+        size_t hi = block_count_;
+        while (hi - lo > 1) {
+            size_t mid = (lo + hi) / 2;
+            if (FirstKey(mid) <= word) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+
+        const char* pos = blob_.data() + Offset(lo);
+        const size_t first_length = ReadVarint(pos);
+        string_view key(pos, first_length);
+        pos += first_length;
+        size_t matched = mismatch(key.begin(), key.end(), word.begin(), word.end()).first - key.begin();
+        if (matched == key.size() && matched == word.size()) return lo * BLOCK_SIZE;
+        // Bytes compare unsigned, as in the std::string order the image was built in
+        if (matched < key.size() && (matched == word.size() || char_traits<char>::lt(word[matched], key[matched]))) return NPOS;
+
+        const size_t block_end = min(keyword_count_, (lo + 1) * BLOCK_SIZE);
+        for (size_t id = lo * BLOCK_SIZE + 1; id < block_end; ++id) {
+            const size_t shared = ReadVarint(pos);
+            const size_t suffix_length = ReadVarint(pos);
+            string_view suffix(pos, suffix_length);
+            pos += suffix_length;
+            // Keys are sorted and the previous key is smaller than word at position matched
+            if (shared < matched) return NPOS;
+            if (shared > matched) continue;
+            string_view rest = word.substr(matched);
+            size_t extra = mismatch(suffix.begin(), suffix.end(), rest.begin(), rest.end()).first - suffix.begin();
+            if (extra == suffix.size() && extra == rest.size()) return id;
+            if (extra < suffix.size() && (extra == rest.size() || char_traits<char>::lt(rest[extra], suffix[extra]))) return NPOS;
+            matched += extra;
+        }
+        return NPOS;
+    }
+
+    template <typename Callback>
+    void ForEachMatch(string_view word, Callback callback) const {
+        size_t id = Find(word);
+        if (id != NPOS) {
+            callback(id);
+        }
+    }
+
+    size_t Size() const {
+        return keyword_count_;
+    }
+
+    string Word(size_t id) const {
+        const char* pos = blob_.data() + Offset(id / BLOCK_SIZE);
+        const size_t first_length = ReadVarint(pos);
+        string word(pos, first_length);
+        pos += first_length;
+        for (size_t i = 0; i < id % BLOCK_SIZE; ++i) {
+            const size_t shared = ReadVarint(pos);
+            const size_t suffix_length = ReadVarint(pos);
+            word.resize(shared);
+            word.append(pos, suffix_length);
+            pos += suffix_length;
+        }
+        return word;
+    }
+
+    size_t MemoryBytes() const {
+        return image_.size();
+    }
+
+    Stats ToStats(const vector<int>& counts) const {
+        Stats result;
+        for (size_t id = 0; id < counts.size(); ++id) {
+            if (counts[id] > 0) {
+                result.word_frequences[Word(id)] = counts[id];
+            }
+        }
+        return result;
+    }
+private:
+    static constexpr string_view MAGIC = "KWFC0001";
+
+    shared_ptr<const void> owner_;
+    string_view image_;
+    size_t keyword_count_ = 0;
+    size_t block_count_ = 0;
+    const char* offsets_ = nullptr;
+    string_view blob_;
+
+    CompactKeyWordsDictionary(string_view image, shared_ptr<const void> owner) {
+        Attach(image, move(owner));
+    }
+
+    void Attach(string_view image, shared_ptr<const void> owner) {
+        owner_ = move(owner);
+        image_ = image;
+        if (image.size() < MAGIC.size() + 16 || image.substr(0, MAGIC.size()) != MAGIC) {
+            throw runtime_error("not a compact keyword dictionary image");
+        }
+        keyword_count_ = ReadWord(image.data() + MAGIC.size());
+        block_count_ = ReadWord(image.data() + MAGIC.size() + 8);
+        offsets_ = image.data() + MAGIC.size() + 16;
+        if (block_count_ > (image.size() - MAGIC.size() - 16) / 8
+            || block_count_ != keyword_count_ / BLOCK_SIZE + (keyword_count_ % BLOCK_SIZE != 0)) {
+            throw runtime_error("corrupted compact keyword dictionary image");
+        }
+        blob_ = image.substr(MAGIC.size() + 16 + 8 * block_count_);
+        Validate();
+    }
+
+    // Walks every block once, so that Find and Word never step outside blob_
+    // on a truncated or corrupted image
+    void Validate() const {
+        const char* pos = blob_.data();
+        const char* const end = blob_.data() + blob_.size();
+        auto corrupted = [] {
+            return runtime_error("corrupted compact keyword dictionary image");
+        };
+        auto read = [&] {
+            uint64_t value = 0;
+            for (int shift = 0; shift < 64 && pos != end; shift += 7) {
+                uint8_t byte = static_cast<uint8_t>(*pos++);
+                value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                if ((byte & 0x80) == 0) return value;
+            }
+            throw corrupted();
+        };
+
+        for (size_t block = 0; block < block_count_; ++block) {
+            if (Offset(block) != static_cast<uint64_t>(pos - blob_.data())) throw corrupted();
+            uint64_t length = read();
+            if (length > static_cast<uint64_t>(end - pos)) throw corrupted();
+            pos += length;
+            const size_t block_end = min(keyword_count_, (block + 1) * BLOCK_SIZE);
+            for (size_t id = block * BLOCK_SIZE + 1; id < block_end; ++id) {
+                const uint64_t shared = read();
+                const uint64_t suffix_length = read();
+                if (shared > length || suffix_length > static_cast<uint64_t>(end - pos)) throw corrupted();
+                pos += suffix_length;
+                length = shared + suffix_length;
+            }
+        }
+        if (pos != end) throw corrupted();
+    }
+
+    static void AppendWord(string& output, uint64_t value) {
+        for (int i = 0; i < 8; ++i) {
+            output += static_cast<char>(value >> (8 * i));
+        }
+    }
+
+    static uint64_t ReadWord(const char* pos) {
+        uint64_t value = 0;
+        for (int i = 0; i < 8; ++i) {
+            value |= static_cast<uint64_t>(static_cast<uint8_t>(pos[i])) << (8 * i);
+        }
+        return value;
+    }
+
+    size_t Offset(size_t block) const {
+        return ReadWord(offsets_ + 8 * block);
+    }
+
+    string_view FirstKey(size_t block) const {
+        const char* pos = blob_.data() + Offset(block);
+        const size_t length = ReadVarint(pos);
+        return string_view(pos, length);
+    }
+};
+
+Stats ExploreKeyWords(const CompactKeyWordsDictionary& dictionary, istream& input) {
+    return dictionary.ToStats(CountKeyWords(dictionary, input));
+}
+
+void TestCompactDictionary() {
+    set<string> key_words = { "yangle", "rocks", "sucks", "all", "a", "yang", "yangles", "zzz", "zeta", "été", "über" };
+    for (int i = 0; i < 100000; ++i) {
+        key_words.insert("entity_name_" + to_string(i * 3));
+    }
+    const CompactKeyWordsDictionary compact(key_words);
+    ASSERT_EQUAL(compact.Size(), key_words.size());
+
+    size_t raw_bytes = 0;
+    size_t id = 0;
+    for (const auto& word : key_words) {
+        raw_bytes += word.size();
+        AssertEqual(compact.Find(word), id, word);
+        AssertEqual(compact.Word(id), word, word);
+        ++id;
+    }
+    ASSERT(3 * compact.MemoryBytes() < raw_bytes);
+    for (const string missing : { "", "0", "yan", "yanglez", "rock", "entity_name_1", "entity_name_", "zzzz", "~", "éta", "ü", "übers" }) {
+        AssertEqual(compact.Find(missing), CompactKeyWordsDictionary::NPOS, missing);
+    }
+
+    const string path = (filesystem::temp_directory_path() / "explore_key_words_dictionary.kwfc").string();
+    compact.Save(path);
+    {
+        const auto mapped = CompactKeyWordsDictionary::Load(path);
+        ASSERT_EQUAL(mapped.Size(), compact.Size());
+        ASSERT_EQUAL(mapped.Find("entity_name_2997"), compact.Find("entity_name_2997"));
+
+        const int OPERATIONS = 3000;
+        string text;
+        for (int i = 0; i < OPERATIONS; ++i) {
+            text += "this new yangle service really rocks\n";
+            text += "It sucks when yangle isn't available entity_name_" + to_string(i) + "\n";
+            text += "Goondex really sucks, but yangle rocks. Use yangle\n";
+        }
+        stringstream compact_input(text);
+        stringstream set_input(text);
+        ASSERT_EQUAL(ExploreKeyWords(mapped, compact_input).word_frequences,
+            ExploreKeyWords(key_words, set_input).word_frequences);
+    }
+
+    for (uintmax_t size : { compact.MemoryBytes() - 3, compact.MemoryBytes() / 2, size_t{ 30 } }) {
+        compact.Save(path);
+        filesystem::resize_file(path, size);
+        bool thrown = false;
+        try {
+            CompactKeyWordsDictionary::Load(path);
+        } catch (const runtime_error&) {
+            thrown = true;
+        }
+        AssertEqual(thrown, true, "truncated to " + to_string(size));
+    }
+    filesystem::remove(path);
+}
+
+using WordRun = vector<pair<string, int>>;
+
+void AccumulateWords(const vector<string>& input, unordered_map<string, int>& counts) {
+    string key;
+    for (const auto& line : input) {
+        ForEachWord(line, [&counts, &key](string_view word) {
+            key.assign(word.data(), word.size());
+            ++counts[key];
+        });
+    }
+}
+
+WordRun ToSortedRun(unordered_map<string, int> counts) {
+    WordRun run;
+    run.reserve(counts.size());
+    while (!counts.empty()) {
+        auto node = counts.extract(counts.begin());
+        run.emplace_back(move(node.key()), node.mapped());
+    }
+    sort(run.begin(), run.end());
+    return run;
+}
+
+WordRun MergeWordRuns(vector<WordRun> runs) {
+    vector<size_t> positions(runs.size());
+    auto later = [&runs, &positions](size_t lhs, size_t rhs) {
+        return runs[lhs][positions[lhs]].first > runs[rhs][positions[rhs]].first;
+    };
+    priority_queue<size_t, vector<size_t>, decltype(later)> heads(later);
+    for (size_t run = 0; run < runs.size(); ++run) {
+        if (!runs[run].empty()) heads.push(run);
+    }
+
+    WordRun result;
+    while (!heads.empty()) {
+        size_t run = heads.top();
+        heads.pop();
+        auto& [word, count] = runs[run][positions[run]];
+        if (!result.empty() && result.back().first == word) {
+            result.back().second += count;
+        } else {
+            result.emplace_back(move(word), count);
+        }
+        if (++positions[run] < runs[run].size()) heads.push(run);
+    }
+    return result;
+}
+
+// Every token with its count, sorted, plus running totals: words sharing a prefix
+// form one contiguous range, so any prefix aggregation is two binary searches
+class PrefixIndex {
+public:
+    explicit PrefixIndex(WordRun words)
+        : words_(move(words)), totals_(words_.size() + 1) {
+        for (size_t i = 0; i < words_.size(); ++i) {
+            totals_[i + 1] = totals_[i] + words_[i].second;
+        }
+    }
+
+    int64_t Count(string_view prefix) const {
+        auto [lo, hi] = Range(prefix);
+        return totals_[hi] - totals_[lo];
+    }
+
+    size_t Distinct(string_view prefix) const {
+        auto [lo, hi] = Range(prefix);
+        return hi - lo;
+    }
+
+    WordRun Matches(string_view prefix) const {
+        auto [lo, hi] = Range(prefix);
+        return WordRun(words_.begin() + lo, words_.begin() + hi);
+    }
+private:
+    WordRun words_;
+    vector<int64_t> totals_;
+
+    pair<size_t, size_t> Range(string_view prefix) const {
+        auto lo = partition_point(words_.begin(), words_.end(), [prefix](const pair<string, int>& entry) {
+            return string_view(entry.first) < prefix;
+        });
+        auto hi = partition_point(lo, words_.end(), [prefix](const pair<string, int>& entry) {
+            return string_view(entry.first).substr(0, prefix.size()) == prefix;
+        });
+        return { lo - words_.begin(), hi - words_.begin() };
+    }
+};
+
+// Each worker turns its word counts into one sorted run when the input ends; the
+// runs are merged into a single run that answers prefix queries by binary search
+PrefixIndex BuildPrefixIndex(istream& input, size_t worker_count = DefaultWorkerCount(), size_t page_size = 10000) {
+    worker_count = max<size_t>(worker_count, 1);
+    PageQueue queue(2 * worker_count);
+    auto workers = StartPageWorkers(queue, worker_count, [&queue](size_t) {
+        unordered_map<string, int> counts;
+        for (Page page; queue.Pop(page);) {
+            AccumulateWords(page.lines, counts);
+        }
+        return ToSortedRun(move(counts));
+    });
+    {
+        PageQueueCloser closer(queue);
+        FeedPages(input, queue, page_size, [] { return false; });
+    }
+
+    vector<WordRun> runs;
+    runs.reserve(workers.size());
+    for (auto& f : workers) {
+        runs.push_back(f.get());
+    }
+    return PrefixIndex(MergeWordRuns(move(runs)));
+}
+
+void TestPrefixCounts() {
+    const int OPERATIONS = 30000;
+    stringstream ss;
+    for (int i = 0; i < OPERATIONS; ++i) {
+        ss << "this new yangle service really rocks\n";
+        ss << "It sucks when yangle isn't available\n";
+        ss << "10 reasons why yangle is the best IT company\n";
+        ss << "yangle rocks others suck\n";
+        ss << "Goondex really sucks, but yangle rocks. Use yangle yang yangzi\n";
+    }
+
+    const auto index = BuildPrefixIndex(ss);
+    ASSERT_EQUAL(index.Count("yang"), 8 * OPERATIONS);
+    ASSERT_EQUAL(index.Distinct("yang"), 3u);
+    ASSERT_EQUAL(index.Count("yangle"), 6 * OPERATIONS);
+    ASSERT_EQUAL(index.Count("suck"), 3 * OPERATIONS);
+    ASSERT_EQUAL(index.Count("rocks"), 3 * OPERATIONS);
+    ASSERT_EQUAL(index.Count("yangles"), 0);
+    ASSERT_EQUAL(index.Count("zzz"), 0);
+    ASSERT_EQUAL(index.Count(""), (6 + 6 + 9 + 4 + 10) * OPERATIONS);
+
+    const auto matches = index.Matches("suck");
+    ASSERT_EQUAL(matches.size(), 3u);
+    ASSERT_EQUAL(matches[0].first, "suck");
+    ASSERT_EQUAL(matches[1].first, "sucks");
+    ASSERT_EQUAL(matches[1].second, OPERATIONS);
+    ASSERT_EQUAL(matches[2].first, "sucks,");
+}
+
+size_t LevenshteinDistance(string_view lhs, string_view rhs) {
+    vector<size_t> row(rhs.size() + 1);
+    iota(row.begin(), row.end(), 0);
+    for (size_t i = 1; i <= lhs.size(); ++i) {
+        size_t diagonal = row[0];
+        row[0] = i;
+        for (size_t j = 1; j <= rhs.size(); ++j) {
+            size_t above = row[j];
+            row[j] = min({ row[j] + 1, row[j - 1] + 1, diagonal + (lhs[i - 1] == rhs[j - 1] ? 0 : 1) });
+            diagonal = above;
+        }
+    }
+    return row[rhs.size()];
+}
+
+// Symmetric-delete index: a keyword and a token within distance d share a string
+// obtained by deleting at most d characters from each. Short keywords get a smaller
+// budget (a third of their length) so that "all" does not swallow every two-letter word.
+class FuzzyKeyWordsMatcher {
+public:
+    static constexpr size_t NPOS = KeyWordsDictionary::NPOS;
+
+    FuzzyKeyWordsMatcher(const set<string>& key_words, size_t max_distance)
+        : dictionary_(key_words), max_distance_(max_distance) {
+        for (size_t id = 0; id < dictionary_.Size(); ++id) {
+            const string& word = dictionary_.Word(id);
+            min_length_ = min(min_length_, word.size());
+            max_length_ = max(max_length_, word.size());
+            string buffer = word;
+            AddDeletions(buffer, Budget(id), [this, id](const string& deletion) {
+                auto [it, inserted] = deletions_.try_emplace(deletion);
+                if (it->second.empty() || it->second.back() != id) {
+                    it->second.push_back(static_cast<uint32_t>(id));
+                }
+            });
+        }
+    }
+
+    size_t Find(string_view word) const {
+        size_t id = dictionary_.Find(word);
+        if (id != NPOS || max_distance_ == 0 || deletions_.empty()) return id;
+        if (word.size() + max_distance_ < min_length_ || word.size() > max_length_ + max_distance_) return NPOS;
+
+        size_t best = NPOS;
+        size_t best_distance = max_distance_ + 1;
+        string buffer(word);
+        AddDeletions(buffer, max_distance_, [&](const string& deletion) {
+            auto it = deletions_.find(deletion);
+            if (it == deletions_.end()) return;
+            for (uint32_t candidate : it->second) {
+                size_t distance = LevenshteinDistance(word, dictionary_.Word(candidate));
+                if (distance <= Budget(candidate)
+                    && (distance < best_distance || (distance == best_distance && candidate < best))) {
+                    best = candidate;
+                    best_distance = distance;
+                }
+            }
+        });
+        return best;
+    }
+
+    template <typename Callback>
+    void ForEachMatch(string_view word, Callback callback) const {
+        size_t id = Find(word);
+        if (id != NPOS) {
+            callback(id);
+        }
+    }
+
+    size_t Size() const {
+        return dictionary_.Size();
+    }
+
+    Stats ToStats(const vector<int>& counts) const {
+        return dictionary_.ToStats(counts);
+    }
+private:
+    KeyWordsDictionary dictionary_;
+    size_t max_distance_;
+    size_t min_length_ = static_cast<size_t>(-1);
+    size_t max_length_ = 0;
+    unordered_map<string, vector<uint32_t>> deletions_;
+
+    size_t Budget(size_t id) const {
+        return min(max_distance_, dictionary_.Word(id).size() / 3);
+    }
+
+    // Calls back with word itself and every string obtained by deleting up to `budget` characters
+    template <typename Callback>
+    static void AddDeletions(string& word, size_t budget, Callback callback, size_t from = 0) {
+        if (from == 0) callback(word);
+        if (budget == 0) return;
+        for (size_t i = from; i < word.size(); ++i) {
+            // Deleting the first of a run of equal characters covers the others
+            if (i > from && word[i] == word[i - 1]) continue;
+            char removed = word[i];
+            word.erase(i, 1);
+            callback(word);
+            AddDeletions(word, budget - 1, callback, i);
+            word.insert(word.begin() + i, removed);
+        }
+    }
+};
+
+Stats ExploreKeyWordsFuzzy(const set<string>& key_words, istream& input, size_t max_distance) {
+    const FuzzyKeyWordsMatcher matcher(key_words, max_distance);
+    return matcher.ToStats(CountKeyWords(matcher, input));
+}
+
+void TestFuzzyKeyWords() {
+    const set<string> key_words = { "yangle", "rocks", "sucks", "all" };
+
+    stringstream ss;
+    ss << "this new yangel service really rocks\n";
+    ss << "It sucks when yngle isn't available\n";
+    ss << "10 reasons why yangle is the best IT company\n";
+    ss << "yangle rokcs others suck\n";
+    ss << "Goondex really sucks, but yangle rocks. Use yangle al a ball\n";
+    const string text = ss.str();
+
+    const auto exact = ExploreKeyWordsFuzzy(key_words, ss, 0);
+    const map<string, int> expected_exact = {
+      {"yangle", 4},
+      {"rocks", 1},
+      {"sucks", 1}
+    };
+    ASSERT_EQUAL(exact.word_frequences, expected_exact);
+
+    stringstream fuzzy_input(text);
+    const auto fuzzy = ExploreKeyWordsFuzzy(key_words, fuzzy_input, 2);
+    const map<string, int> expected_fuzzy = {
+      {"yangle", 6},
+      {"rocks", 2},
+      {"sucks", 3},
+      {"all", 2}
+    };
+    ASSERT_EQUAL(fuzzy.word_frequences, expected_fuzzy);
+
+    ASSERT_EQUAL(LevenshteinDistance("yangel", "yangle"), 2u);
+    ASSERT_EQUAL(LevenshteinDistance("", "abc"), 3u);
+    ASSERT_EQUAL(LevenshteinDistance("kitten", "sitting"), 3u);
+
+    const int OPERATIONS = 30000;
+    string long_text = MakeYangleText(OPERATIONS);
+    for (size_t distance : { 0, 1, 2 }) {
+        LOG_DURATION("Fuzzy matching, distance " + to_string(distance) + ": ");
+        stringstream long_input(long_text);
+        ExploreKeyWordsFuzzy(key_words, long_input, distance);
+    }
+}
+
+// Keyword set fixed at compile time: words are ordered by length and packed into two
+// 64-bit words each, so a lookup is a jump to the token's length bucket followed by
+// a couple of integer compares. Words longer than MAX_PACKED bytes fall back to ==.
+template <size_t N>
+class StaticKeyWords {
+public:
+    static constexpr size_t NPOS = static_cast<size_t>(-1);
+    static constexpr size_t MAX_PACKED = 16;
+
+    constexpr explicit StaticKeyWords(array<string_view, N> words) : words_(words) {
+        for (size_t i = 1; i < N; ++i) {
+            for (size_t j = i; j > 0 && Before(words_[j], words_[j - 1]); --j) {
+                string_view tmp = words_[j];
+                words_[j] = words_[j - 1];
+                words_[j - 1] = tmp;
+            }
+        }
+        for (size_t length = 0, id = 0; length <= MAX_PACKED + 1; ++length) {
+            while (id < N && words_[id].size() < length) ++id;
+            first_[length] = id;
+        }
+        first_[MAX_PACKED + 2] = N;
+        for (size_t id = 0; id < N; ++id) {
+            low_[id] = PackWord(words_[id], 0);
+            high_[id] = PackWord(words_[id], 8);
+        }
+    }
+
+    size_t Find(string_view word) const {
+        if (word.size() > MAX_PACKED) {
+            for (size_t id = first_[MAX_PACKED + 1]; id < N; ++id) {
+                if (words_[id] == word) return id;
+            }
+            return NPOS;
+        }
+        const size_t begin = first_[word.size()];
+        const size_t end = first_[word.size() + 1];
+        if (begin == end) return NPOS;
+
+        const uint64_t low = LoadWord(word, 0);
+        const uint64_t high = LoadWord(word, 8);
+        for (size_t id = begin; id < end; ++id) {
+            if (((low ^ low_[id]) | (high ^ high_[id])) == 0) return id;
+        }
+        return NPOS;
+    }
+
+    template <typename Callback>
+    void ForEachMatch(string_view word, Callback callback) const {
+        size_t id = Find(word);
+        if (id != NPOS) {
+            callback(id);
+        }
+    }
+
+    constexpr size_t Size() const {
+        return N;
+    }
+
+    constexpr string_view Word(size_t id) const {
+        return words_[id];
+    }
+
+    Stats ToStats(const vector<int>& counts) const {
+        Stats result;
+        for (size_t id = 0; id < counts.size(); ++id) {
+            if (counts[id] > 0) {
+                result.word_frequences[string(words_[id])] += counts[id];
+            }
+        }
+        return result;
+    }
+private:
+    array<string_view, N> words_;
+    array<size_t, MAX_PACKED + 3> first_ = {};
+    array<uint64_t, N> low_ = {};
+    array<uint64_t, N> high_ = {};
+
+    static constexpr bool Before(string_view lhs, string_view rhs) {
+        return lhs.size() < rhs.size() || (lhs.size() == rhs.size() && lhs < rhs);
+    }
+
+    // Same layout as LoadWord: byte i of the chunk goes to bits 8*i, missing bytes are zero
+    static constexpr uint64_t PackWord(string_view word, size_t offset) {
+        uint64_t result = 0;
+        for (size_t i = 0; i < 8 && offset + i < word.size(); ++i) {
+            result |= static_cast<uint64_t>(static_cast<uint8_t>(word[offset + i])) << (8 * i);
+        }
+        return result;
+    }
+
+    static uint64_t LoadWord(string_view word, size_t offset) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        return PackWord(word, offset);
+#else
+        char buffer[8] = {};
+        if (offset < word.size()) {
+            memcpy(buffer, word.data() + offset, min<size_t>(8, word.size() - offset));
+        }
+        uint64_t result;
+        memcpy(&result, buffer, sizeof(result));
+        return result;
+#endif
+    }
+};
+
+template <typename... Words>
+constexpr auto MakeStaticKeyWords(const Words&... words) {
+    return StaticKeyWords<sizeof...(Words)>({ string_view(words)... });
+}
+
+template <const auto& KeyWords>
+Stats ExploreKeyWords(istream& input) {
+    return KeyWords.ToStats(CountKeyWords(KeyWords, input));
+}
+
+constexpr auto BASIC_KEY_WORDS = MakeStaticKeyWords("yangle", "rocks", "sucks", "all");
+constexpr auto MIXED_KEY_WORDS = MakeStaticKeyWords(
+    "a", "rocks", "sixteen_letters!", "seventeen_letters", "a_much_longer_keyword_than_sixteen", "sucks");
+
+static_assert(BASIC_KEY_WORDS.Size() == 4);
+static_assert(BASIC_KEY_WORDS.Word(0) == "all" && BASIC_KEY_WORDS.Word(3) == "yangle");
+
+void TestStaticKeyWords() {
+    {
+        stringstream ss(MakeYangleText(1));
+
+        const auto stats = ExploreKeyWords<BASIC_KEY_WORDS>(ss);
+        const map<string, int> expected = {
+          {"yangle", 6},
+          {"rocks", 2},
+          {"sucks", 1}
+        };
+        ASSERT_EQUAL(stats.word_frequences, expected);
+    }
+    {
+        stringstream ss;
+        ss << "a rocks sixteen_letters! sixteen_letters? seventeen_letters\n";
+        ss << "a_much_longer_keyword_than_sixteen a_much_longer_keyword_than_sixteem aa sucks rock\n";
+
+        const auto stats = ExploreKeyWords<MIXED_KEY_WORDS>(ss);
+        const map<string, int> expected = {
+          {"a", 1},
+          {"rocks", 1},
+          {"sixteen_letters!", 1},
+          {"seventeen_letters", 1},
+          {"a_much_longer_keyword_than_sixteen", 1},
+          {"sucks", 1}
+        };
+        ASSERT_EQUAL(stats.word_frequences, expected);
+        ASSERT_EQUAL(MIXED_KEY_WORDS.Find(""), MIXED_KEY_WORDS.NPOS);
+    }
+    {
+        const set<string> key_words = { "yangle", "rocks", "sucks", "all" };
+        const int OPERATIONS = 30000;
+        string text = MakeYangleText(OPERATIONS);
+
+        Stats dynamic_stats, static_stats;
+        {
+            LOG_DURATION("Runtime keyword set: ");
+            stringstream ss(text);
+            dynamic_stats = ExploreKeyWords(key_words, ss);
+        }
+        {
+            LOG_DURATION("Compile-time keyword set: ");
+            stringstream ss(text);
+            static_stats = ExploreKeyWords<BASIC_KEY_WORDS>(ss);
+        }
+        ASSERT_EQUAL(static_stats.word_frequences, dynamic_stats.word_frequences);
+    }
+}
+
+// Runtime matcher for small keyword sets: keywords up to 16 bytes are zero-padded to a
+// 16-byte block and grouped by length, so a token is compared against its length group
+// with one SSE2 compare per keyword (two 64-bit compares without SSE2). Longer keywords
+// go through the hashed dictionary. With hundreds of keywords of one length the linear
+// scan of a group loses to hashing, so this is meant for short lists.
+class PackedKeyWordsMatcher {
+public:
+    static constexpr size_t NPOS = KeyWordsDictionary::NPOS;
+    static constexpr size_t MAX_PACKED = 16;
+
+    explicit PackedKeyWordsMatcher(const set<string>& key_words)
+        : dictionary_(key_words), groups_(MAX_PACKED + 1) {
+        for (size_t id = 0; id < dictionary_.Size(); ++id) {
+            const string& word = dictionary_.Word(id);
+            if (word.size() <= MAX_PACKED) {
+                groups_[word.size()].push_back({ Pack(word), id });
+            }
+        }
+    }
+
+    size_t Find(string_view word) const {
+        if (word.size() > MAX_PACKED) {
+            return dictionary_.Find(word);
+        }
+        const auto& group = groups_[word.size()];
+        if (group.empty()) return NPOS;
+
+        const PackedWord token = Pack(word);
+#ifdef KEYWORDS_USE_SSE2
+        const __m128i value = _mm_load_si128(reinterpret_cast<const __m128i*>(token.bytes));
+        for (const auto& entry : group) {
+            const __m128i key = _mm_load_si128(reinterpret_cast<const __m128i*>(entry.word.bytes));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(value, key)) == 0xFFFF) return entry.id;
+        }
+#else
+        uint64_t value[2];
+        memcpy(value, token.bytes, sizeof(value));
+        for (const auto& entry : group) {
+            uint64_t key[2];
+            memcpy(key, entry.word.bytes, sizeof(key));
+            if (((value[0] ^ key[0]) | (value[1] ^ key[1])) == 0) return entry.id;
+        }
+#endif
+        return NPOS;
+    }
+
+    template <typename Callback>
+    void ForEachMatch(string_view word, Callback callback) const {
+        size_t id = Find(word);
+        if (id != NPOS) {
+            callback(id);
+        }
+    }
+
+    size_t Size() const {
+        return dictionary_.Size();
+    }
+
+    Stats ToStats(const vector<int>& counts) const {
+        return dictionary_.ToStats(counts);
+    }
+private:
+    struct alignas(16) PackedWord {
+        char bytes[MAX_PACKED];
+    };
+
+    struct Entry {
+        PackedWord word;
+        size_t id;
+    };
+
+    KeyWordsDictionary dictionary_;
+    vector<vector<Entry>> groups_;
+
+    static PackedWord Pack(string_view word) {
+        PackedWord result = {};
+        memcpy(result.bytes, word.data(), word.size());
+        return result;
+    }
+};
+
+Stats ExploreKeyWords(const PackedKeyWordsMatcher& matcher, istream& input) {
+    return matcher.ToStats(CountKeyWords(matcher, input));
+}
+
+void TestPackedKeyWords() {
+    {
+        const set<string> key_words = {
+            "yangle", "rocks", "sucks", "all", "", "sixteen_letters!", "seventeen_letters"
+        };
+        const PackedKeyWordsMatcher matcher(key_words);
+        for (const string& word : key_words) {
+            ASSERT(matcher.Find(word) != matcher.NPOS);
+        }
+        for (const string& word : { "rock"s, "rockss"s, "Rocks"s, "sixteen_letters?"s, "seventeen_letterz"s, "al\0"s }) {
+            ASSERT_EQUAL(matcher.Find(word), matcher.NPOS);
+        }
+    }
+    {
+        const set<string> key_words = { "yangle", "rocks", "sucks", "all" };
+        stringstream ss(MakeYangleText(1));
+
+        const auto stats = ExploreKeyWords(PackedKeyWordsMatcher(key_words), ss);
+        const map<string, int> expected = {
+          {"yangle", 6},
+          {"rocks", 2},
+          {"sucks", 1}
+        };
+        ASSERT_EQUAL(stats.word_frequences, expected);
+    }
+    {
+        const set<string> key_words = { "yangle", "rocks", "sucks", "all" };
+        const PackedKeyWordsMatcher matcher(key_words);
+        vector<string> tokens;
+        for (int i = 0; i < 30000; ++i) {
+            for (const char* word : { "this", "new", "yangle", "service", "really", "rocks",
+                                      "It", "sucks", "when", "isn't", "available" }) {
+                tokens.push_back(word);
+            }
+        }
+
+        size_t found_by_set = 0, found_by_matcher = 0;
+        {
+            LOG_DURATION("set<string>::find per token: ");
+            for (const string& token : tokens) {
+                found_by_set += key_words.find(token) != key_words.end();
+            }
+        }
+        {
+            LOG_DURATION("Packed compare per token: ");
+            for (const string& token : tokens) {
+                found_by_matcher += matcher.Find(token) != matcher.NPOS;
+            }
+        }
+        ASSERT_EQUAL(found_by_matcher, found_by_set);
+    }
+}
+
+void TestPerWorkerAccumulation() {
+    const set<string> key_words = { "yangle", "rocks", "sucks", "all" };
+    const int LINES = 95000;
+
+    vector<string> lines;
+    string text;
+    for (int i = 0; i < LINES; ++i) {
+        string line = "line " + to_string(i) + (i % 3 == 0 ? " yangle" : "") + (i % 7 == 0 ? " rocks all" : "")
+            + (i % 11 == 0 ? " sucks sucks" : "");
+        text += line + "\n";
+        lines.push_back(move(line));
+    }
+
+    Stats expected;
+    {
+        LOG_DURATION("Per-line Stats merge: ");
+        // The previous scheme: a fresh Stats per line, merged into its page, one task per page
+        auto explore_page = [&key_words](vector<string> page) {
+            Stats result;
+            for (const auto& line : page) {
+                result += ExploreLine(key_words, line);
+            }
+            return result;
+        };
+        vector<future<Stats>> pages;
+        for (size_t begin = 0; begin < lines.size(); begin += 10000) {
+            const size_t end = min(lines.size(), begin + 10000);
+            pages.push_back(async(explore_page, vector<string>(lines.begin() + begin, lines.begin() + end)));
+        }
+        for (auto& f : pages) {
+            expected += f.get();
+        }
+    }
+    ASSERT_EQUAL(expected.word_frequences.at("sucks"), 2 * ((LINES + 10) / 11));
+
+    stringstream ss(text);
+    Stats stats;
+    {
+        LOG_DURATION("Per-worker accumulation: ");
+        stats = ExploreKeyWords(key_words, ss);
+    }
+    ASSERT_EQUAL(stats.word_frequences, expected.word_frequences);
+
+    stringstream empty;
+    ASSERT(ExploreKeyWords(key_words, empty).word_frequences.empty());
+}
+
+void TestSharedCounters() {
+    using Accumulation = ScanOptions::Accumulation;
+    const set<string> key_words = { "yangle", "rocks", "sucks", "all" };
+    const KeyWordsDictionary dictionary(key_words);
+    const int OPERATIONS = 20000;
+    const size_t PAGE_SIZE = 1000;
+    const map<string, int> expected = {
+      {"yangle", 6 * OPERATIONS},
+      {"rocks", 2 * OPERATIONS},
+      {"sucks", OPERATIONS}
+    };
+
+    // Pages are split up front and only moved into the queue, so the timings cover
+    // counting and accumulation rather than the single reader
+    vector<vector<string>> pages;
+    {
+        stringstream ss(MakeYangleText(OPERATIONS));
+        for (auto page = FetchMore(PAGE_SIZE, ss); !page.empty(); page = FetchMore(PAGE_SIZE, ss)) {
+            pages.push_back(move(page));
+        }
+    }
+    auto push_pages = [](PageQueue& queue, vector<vector<string>> input) {
+        for (size_t i = 0; i < input.size(); ++i) {
+            queue.Push({ i, move(input[i]), 0, nullptr });
+        }
+        queue.Close();
+    };
+
+    auto per_page_stats = [&key_words, &push_pages](size_t threads, vector<vector<string>> input) {
+        PageQueue queue(2 * threads);
+        auto worker = [&key_words, &queue] {
+            Stats local;
+            for (Page page; queue.Pop(page);) {
+                local += ExploreLinesVector(key_words, move(page.lines));
+            }
+            return local;
+        };
+        vector<future<Stats>> workers;
+        for (size_t i = 0; i < threads; ++i) {
+            workers.push_back(async(launch::async, worker));
+        }
+        push_pages(queue, move(input));
+        Stats result;
+        for (auto& f : workers) {
+            result += f.get();
+        }
+        return result;
+    };
+
+    auto scan_pages = [&dictionary, &push_pages](Accumulation accumulation, size_t threads, vector<vector<string>> input) {
+        ScanOptions options;
+        options.worker_count = threads;
+        options.accumulation = accumulation;
+        ScanContext<KeyWordsDictionary> context(dictionary, options);
+        vector<future<ScanResult>> workers;
+        for (size_t i = 0; i < threads; ++i) {
+            workers.push_back(async(launch::async, ScanWorker<KeyWordsDictionary>, ref(context), i));
+        }
+        push_pages(context.queue, move(input));
+        vector<int> counts(dictionary.Size());
+        for (auto& f : workers) {
+            AddCounts(counts, f.get().counts);
+        }
+        if (context.shared_counts) {
+            counts = context.shared_counts->Totals();
+        } else if (context.sharded_counts) {
+            counts = context.sharded_counts->Totals();
+        }
+        return dictionary.ToStats(counts);
+    };
+
+    const vector<pair<Accumulation, string>> strategies = {
+        {Accumulation::PerWorker, "per-worker vector merge"},
+        {Accumulation::SharedAtomic, "shared atomics"},
+        {Accumulation::StripedAtomic, "striped atomics"},
+        {Accumulation::PerThreadRows, "per-thread rows"}
+    };
+    for (size_t threads : { 1, 2, 4, 8, 16, 32, 64 }) {
+        {
+            auto input = pages;
+            Stats stats;
+            {
+                LOG_DURATION(to_string(threads) + " threads, per-page Stats merge: ");
+                stats = per_page_stats(threads, move(input));
+            }
+            ASSERT_EQUAL(stats.word_frequences, expected);
+        }
+        for (const auto& [accumulation, name] : strategies) {
+            auto input = pages;
+            Stats stats;
+            {
+                LOG_DURATION(to_string(threads) + " threads, " + name + ": ");
+                stats = scan_pages(accumulation, threads, move(input));
+            }
+            ASSERT_EQUAL(stats.word_frequences, expected);
+        }
+    }
+
+    SharedKeyWordCounters counters(3, 2);
+    counters.Add(0, 1);
+    counters.Add(1, 1);
+    counters.Add(2, 2);
+    ASSERT_EQUAL(counters.Totals(), vector<int>({ 0, 2, 1 }));
+}
+
+void TestShardedCounters() {
+    {
+        for (auto mode : { ShardedCounters::Mode::PerThread, ShardedCounters::Mode::ApproximateCpu }) {
+            ShardedCounters counters(10, mode, 3);
+            counters.Add(0);
+            counters.Add(9, 5);
+            async(launch::async, [&counters] { counters.Add(9, -2); }).get();
+            ASSERT_EQUAL(counters.Sum(9), 3);
+            ASSERT_EQUAL(counters.Totals(), vector<int>({ 1, 0, 0, 0, 0, 0, 0, 0, 0, 3 }));
+        }
+    }
+    {
+        const size_t thread_count = 4;
+        const int key_count = 50000;
+        auto run_updates = [&](auto increment) {
+            auto kernel = [&](int seed) {
+                vector<int> updates(key_count);
+                iota(begin(updates), end(updates), 0);
+                shuffle(begin(updates), end(updates), default_random_engine(seed));
+                for (int i = 0; i < 2; ++i) {
+                    for (auto key : updates) {
+                        increment(key);
+                    }
+                }
+            };
+            vector<future<void>> futures;
+            for (size_t i = 0; i < thread_count; ++i) {
+                futures.push_back(async(launch::async, kernel, static_cast<int>(i)));
+            }
+        };
+
+        ShardedCounters per_thread(key_count);
+        {
+            LOG_DURATION("Per-thread counter rows: ");
+            run_updates([&per_thread](int key) { per_thread.Add(key); });
+        }
+        ShardedCounters per_cpu(key_count, ShardedCounters::Mode::ApproximateCpu);
+        {
+            LOG_DURATION("Approximate per-CPU counter rows: ");
+            run_updates([&per_cpu](int key) { per_cpu.Add(key); });
+        }
+        vector<atomic<int64_t>> shared(key_count);
+        {
+            LOG_DURATION("Shared atomic counters: ");
+            run_updates([&shared](int key) { shared[key].fetch_add(1, memory_order_relaxed); });
+        }
+        for (int key = 0; key < key_count; ++key) {
+            AssertEqual(per_thread.Sum(key), static_cast<int64_t>(2 * thread_count), "Key = " + to_string(key));
+            AssertEqual(per_cpu.Sum(key), static_cast<int64_t>(2 * thread_count), "Key = " + to_string(key));
+            AssertEqual(shared[key].load(), static_cast<int64_t>(2 * thread_count), "Key = " + to_string(key));
+        }
+    }
+    {
+        const set<string> key_words = { "yangle", "rocks", "sucks", "all" };
+        stringstream ss;
+        for (int i = 0; i < 20000; ++i) {
+            ss << "yangle rocks others suck\n";
+            ss << "Goondex really sucks, but yangle rocks. Use yangle\n";
+        }
+        const auto stats = ExploreKeyWords(key_words, ss, ScanOptions::Accumulation::PerThreadRows, 8);
+        const map<string, int> expected = {
+          {"yangle", 60000},
+          {"rocks", 20000}
+        };
+        ASSERT_EQUAL(stats.word_frequences, expected);
+    }
+}
+
+struct SpillOptions {
+    size_t memory_budget = size_t(64) << 20;
+    size_t worker_count = DefaultWorkerCount();
+    size_t page_size = 10000;
+    filesystem::path directory = filesystem::temp_directory_path();
+};
+
+constexpr size_t MAX_MERGE_FAN_IN = 64;
+
+struct SpillStatistics {
+    size_t runs = 0;
+    uint64_t bytes_spilled = 0;
+    uint64_t distinct_words = 0;
+};
+
+// Run file: (varint length, word bytes, varint count) records in word order
+class WordRunWriter {
+public:
+    explicit WordRunWriter(const filesystem::path& path) : output_(path, ios::binary) {
+        if (!output_) {
+            throw runtime_error("cannot create spill run " + path.string());
+        }
+    }
+
+    void Write(string_view word, uint64_t count) {
+        WriteVarint(output_, word.size());
+        output_.write(word.data(), word.size());
+        WriteVarint(output_, count);
+    }
+
+    uint64_t Finish() {
+        output_.flush();
+        if (!output_) {
+            throw runtime_error("failed to write spill run");
+        }
+        return static_cast<uint64_t>(output_.tellp());
+    }
+private:
+    ofstream output_;
+};
+
+class WordRunReader {
+public:
+    explicit WordRunReader(const filesystem::path& path) : input_(path, ios::binary) {
+        if (!input_) {
+            throw runtime_error("cannot open spill run " + path.string());
+        }
+        Advance();
+    }
+
+    bool Done() const {
+        return done_;
+    }
+
+    const string& Word() const {
+        return word_;
+    }
+
+    uint64_t Count() const {
+        return count_;
+    }
+
+    void Advance() {
+        if (input_.peek() == char_traits<char>::eof()) {
+            done_ = true;
+            return;
+        }
+        word_.resize(ReadVarint(input_));
+        input_.read(word_.data(), word_.size());
+        count_ = ReadVarint(input_);
+    }
+private:
+    ifstream input_;
+    string word_;
+    uint64_t count_ = 0;
+    bool done_ = false;
+};
+
+// Deletes the run files it was given, including when the merge throws
+class SpillDirectory {
+public:
+    explicit SpillDirectory(filesystem::path directory) : directory_(move(directory)) {
+        random_device device;
+        prefix_ = "kwspill-" + to_string(device()) + "-" + to_string(device()) + "-";
+    }
+
+    SpillDirectory(const SpillDirectory&) = delete;
+    SpillDirectory& operator=(const SpillDirectory&) = delete;
+
+    ~SpillDirectory() {
+        for (const auto& path : runs_) {
+            error_code ignored;
+            filesystem::remove(path, ignored);
+        }
+    }
+
+    filesystem::path NewRun() {
+        lock_guard<mutex> guard(mutex_);
+        runs_.push_back(directory_ / (prefix_ + to_string(runs_.size()) + ".run"));
+        return runs_.back();
+    }
+
+    const vector<filesystem::path>& Runs() const {
+        return runs_;
+    }
+private:
+    filesystem::path directory_;
+    string prefix_;
+    mutex mutex_;
+    vector<filesystem::path> runs_;
+};
+
+// Word counts of one worker; once the table's estimated size passes the budget it is
+// sorted and written out as a run, and counting starts over with an empty table
+class SpillingWordCounter {
+public:
+    SpillingWordCounter(SpillDirectory& directory, size_t memory_budget)
+        : directory_(directory), memory_budget_(memory_budget) {
+    }
+
+    void Add(string_view word) {
+        key_.assign(word.data(), word.size());
+        auto [it, inserted] = counts_.try_emplace(key_, 0);
+        ++it->second;
+        if (inserted) {
+            memory_used_ += word.size() + ENTRY_OVERHEAD;
+            if (memory_used_ > memory_budget_) {
+                Spill();
+            }
+        }
+    }
+
+    void Spill() {
+        if (counts_.empty()) return;
+        vector<const pair<const string, uint64_t>*> entries;
+        entries.reserve(counts_.size());
+        for (const auto& entry : counts_) {
+            entries.push_back(&entry);
+        }
+        sort(entries.begin(), entries.end(), [](const auto* lhs, const auto* rhs) {
+            return lhs->first < rhs->first;
+        });
+
+        WordRunWriter writer(directory_.NewRun());
+        for (const auto* entry : entries) {
+            writer.Write(entry->first, entry->second);
+        }
+        statistics_.bytes_spilled += writer.Finish();
+        ++statistics_.runs;
+        counts_.clear();
+        memory_used_ = 0;
+    }
+
+    const SpillStatistics& Statistics() const {
+        return statistics_;
+    }
+private:
+    static constexpr size_t ENTRY_OVERHEAD = sizeof(pair<const string, uint64_t>) + 2 * sizeof(void*);
+
+    SpillDirectory& directory_;
+    size_t memory_budget_;
+    size_t memory_used_ = 0;
+    string key_;
+    unordered_map<string, uint64_t> counts_;
+    SpillStatistics statistics_;
+};
+
+// Streams the union of sorted runs with the counts of equal words added up
+void MergeSpilledRuns(const vector<filesystem::path>& runs, const function<void(string_view, uint64_t)>& output) {
+    vector<WordRunReader> readers;
+    readers.reserve(runs.size());
+    for (const auto& path : runs) {
+        readers.emplace_back(path);
+    }
+    auto later = [&readers](size_t lhs, size_t rhs) {
+        return readers[lhs].Word() > readers[rhs].Word();
+    };
+    priority_queue<size_t, vector<size_t>, decltype(later)> heads(later);
+    for (size_t run = 0; run < readers.size(); ++run) {
+        if (!readers[run].Done()) heads.push(run);
+    }
+
+    string word;
+    uint64_t count = 0;
+    while (!heads.empty()) {
+        size_t run = heads.top();
+        heads.pop();
+        auto& reader = readers[run];
+        if (count > 0 && reader.Word() == word) {
+            count += reader.Count();
+        } else {
+            if (count > 0) output(word, count);
+            word = reader.Word();
+            count = reader.Count();
+        }
+        reader.Advance();
+        if (!reader.Done()) heads.push(run);
+    }
+    if (count > 0) output(word, count);
+}
+
+// Counts every word of the input within roughly memory_budget bytes of tables: workers
+// spill sorted runs to disk and the runs are merged k-way, streaming each distinct
+// word with its total to output in sorted order. More than MAX_MERGE_FAN_IN runs are
+// first merged in groups so the number of open files stays bounded.
+SpillStatistics CountWordsSpilling(istream& input, const function<void(string_view, uint64_t)>& output,
+    const SpillOptions& options = {}) {
+    SpillDirectory directory(options.directory);
+    const size_t worker_count = max<size_t>(options.worker_count, 1);
+    PageQueue queue(2 * worker_count);
+
+    auto workers = StartPageWorkers(queue, worker_count, [&](size_t) {
+        SpillingWordCounter counter(directory, options.memory_budget / worker_count);
+        for (Page page; queue.Pop(page);) {
+            for (const auto& line : page.lines) {
+                ForEachWord(line, [&counter](string_view word) {
+                    counter.Add(word);
+                });
+            }
+        }
+        counter.Spill();
+        return counter.Statistics();
+    });
+    {
+        PageQueueCloser closer(queue);
+        FeedPages(input, queue, options.page_size, [] { return false; });
+    }
+    SpillStatistics statistics;
+    for (auto& f : workers) {
+        auto partial = f.get();
+        statistics.runs += partial.runs;
+        statistics.bytes_spilled += partial.bytes_spilled;
+    }
+
+    vector<filesystem::path> runs = directory.Runs();
+    while (runs.size() > MAX_MERGE_FAN_IN) {
+        vector<filesystem::path> merged_runs;
+        for (size_t begin = 0; begin < runs.size(); begin += MAX_MERGE_FAN_IN) {
+            const vector<filesystem::path> group(runs.begin() + begin,
+                runs.begin() + min(runs.size(), begin + MAX_MERGE_FAN_IN));
+            merged_runs.push_back(directory.NewRun());
+            WordRunWriter writer(merged_runs.back());
+            MergeSpilledRuns(group, [&writer](string_view word, uint64_t count) {
+                writer.Write(word, count);
+            });
+            writer.Finish();
+            for (const auto& path : group) {
+                filesystem::remove(path);
+            }
+        }
+        runs = move(merged_runs);
+    }
+
+    MergeSpilledRuns(runs, [&](string_view word, uint64_t count) {
+        output(word, count);
+        ++statistics.distinct_words;
+    });
+    return statistics;
+}
+
+void TestSpillingWordCounts() {
+    const int LINES = 20000;
+    string text;
+    for (int i = 0; i < LINES; ++i) {
+        text += "word" + to_string(i % 7919) + " yangle rare" + to_string(i) + " rocks\n";
+    }
+
+    stringstream reference_input(text);
+    const WordRun reference = BuildPrefixIndex(reference_input).Matches("");
+    const map<string, int> expected(reference.begin(), reference.end());
+    const auto spill_directory = filesystem::temp_directory_path() / "explore_key_words_spill";
+    filesystem::create_directories(spill_directory);
+
+    for (size_t budget : { size_t(64) << 20, size_t(256) << 10, size_t(16) << 10 }) {
+        SpillOptions options;
+        options.memory_budget = budget;
+        options.page_size = 1000;
+        options.directory = spill_directory;
+
+        stringstream ss(text);
+        WordRun merged;
+        bool sorted = true;
+        const auto statistics = CountWordsSpilling(ss, [&](string_view word, uint64_t count) {
+            sorted = sorted && (merged.empty() || merged.back().first < word);
+            merged.emplace_back(word, static_cast<int>(count));
+        }, options);
+
+        ASSERT(sorted);
+        const map<string, int> counts(merged.begin(), merged.end());
+        ASSERT_EQUAL(counts, expected);
+        ASSERT_EQUAL(statistics.distinct_words, expected.size());
+        if (budget < (size_t(1) << 20)) {
+            ASSERT(statistics.runs > options.worker_count);
+            ASSERT(statistics.bytes_spilled > 0);
+        }
+        if (budget < (size_t(64) << 10)) {
+            ASSERT(statistics.runs > MAX_MERGE_FAN_IN);
+        }
+    }
+
+    ASSERT(filesystem::is_empty(spill_directory));
+    filesystem::remove(spill_directory);
+
+    for (size_t workers : { 1, 4 }) {
+        SpillOptions options;
+        options.memory_budget = 1 << 10;
+        options.worker_count = workers;
+        options.page_size = 100;
+        options.directory = spill_directory / "missing";
+
+        stringstream ss(text);
+        bool thrown = false;
+        try {
+            CountWordsSpilling(ss, [](string_view, uint64_t) {}, options);
+        } catch (const runtime_error&) {
+            thrown = true;
+        }
+        AssertEqual(thrown, true, "workers = " + to_string(workers));
+    }
+
+    stringstream empty;
+    size_t calls = 0;
+    CountWordsSpilling(empty, [&calls](string_view, uint64_t) { ++calls; });
+    ASSERT_EQUAL(calls, 0u);
+}
+
+// Sorts chunks concurrently, then merges neighbouring chunks pairwise, also concurrently
+template <typename RandomIt, typename Less>
+void ParallelSort(RandomIt first, RandomIt last, Less less, size_t worker_count) {
+    const size_t size = static_cast<size_t>(last - first);
+    const size_t MIN_CHUNK = 1 << 14;
+    const size_t chunk_count = max<size_t>(1, min(worker_count, size / MIN_CHUNK));
+    if (chunk_count == 1) {
+        sort(first, last, less);
+        return;
+    }
+
+    vector<RandomIt> bounds;
+    for (size_t i = 0; i <= chunk_count; ++i) {
+        bounds.push_back(first + size * i / chunk_count);
+    }
+    {
+        vector<future<void>> sorts;
+        for (size_t i = 0; i < chunk_count; ++i) {
+            sorts.push_back(async(launch::async, [&bounds, &less, i] {
+                sort(bounds[i], bounds[i + 1], less);
+            }));
+        }
+    }
+    while (bounds.size() > 2) {
+        vector<RandomIt> merged_bounds;
+        vector<future<void>> merges;
+        for (size_t i = 0; i + 2 < bounds.size(); i += 2) {
+            merges.push_back(async(launch::async, [&bounds, &less, i] {
+                inplace_merge(bounds[i], bounds[i + 1], bounds[i + 2], less);
+            }));
+            merged_bounds.push_back(bounds[i]);
+        }
+        if (bounds.size() % 2 == 0) {
+            merged_bounds.push_back(bounds[bounds.size() - 2]);
+        }
+        merged_bounds.push_back(bounds.back());
+        for (auto& f : merges) {
+            f.get();
+        }
+        bounds = move(merged_bounds);
+    }
+}
+
+// Keywords with a non-zero count, most frequent first; equal counts keep id order,
+// which for dictionaries built from a set is alphabetical. With top given, only the
+// first top entries are selected (per-chunk partial sorts, then one over the winners).
+template <typename Dictionary>
+WordRun SortByFrequency(const Dictionary& dictionary, const vector<int>& counts,
+    size_t top = numeric_limits<size_t>::max(), size_t worker_count = DefaultWorkerCount()) {
+    vector<uint32_t> ids;
+    for (size_t id = 0; id < counts.size(); ++id) {
+        if (counts[id] > 0) ids.push_back(static_cast<uint32_t>(id));
+    }
+    auto more_frequent = [&counts](uint32_t lhs, uint32_t rhs) {
+        return counts[lhs] != counts[rhs] ? counts[lhs] > counts[rhs] : lhs < rhs;
+    };
+    worker_count = max<size_t>(worker_count, 1);
+
+    if (top < ids.size()) {
+        const size_t MIN_CHUNK = 1 << 14;
+        const size_t chunk_count = max<size_t>(1, min(worker_count, ids.size() / MIN_CHUNK));
+        vector<future<vector<uint32_t>>> chunks;
+        for (size_t i = 0; i < chunk_count; ++i) {
+            chunks.push_back(async(launch::async, [&, i] {
+                auto begin = ids.begin() + ids.size() * i / chunk_count;
+                auto end = ids.begin() + ids.size() * (i + 1) / chunk_count;
+                auto middle = begin + min<size_t>(top, end - begin);
+                partial_sort(begin, middle, end, more_frequent);
+                return vector<uint32_t>(begin, middle);
+            }));
+        }
+        vector<uint32_t> candidates;
+        for (auto& f : chunks) {
+            auto chunk = f.get();
+            candidates.insert(candidates.end(), chunk.begin(), chunk.end());
+        }
+        partial_sort(candidates.begin(), candidates.begin() + top, candidates.end(), more_frequent);
+        candidates.resize(top);
+        ids = move(candidates);
+    } else {
+        ParallelSort(ids.begin(), ids.end(), more_frequent, worker_count);
+    }
+
+    WordRun result(ids.size());
+    const size_t fill_count = max<size_t>(1, min(worker_count, ids.size() / (1 << 14)));
+    vector<future<void>> fills;
+    for (size_t i = 0; i < fill_count; ++i) {
+        fills.push_back(async(launch::async, [&, i] {
+            for (size_t pos = ids.size() * i / fill_count; pos < ids.size() * (i + 1) / fill_count; ++pos) {
+                result[pos] = { dictionary.Word(ids[pos]), counts[ids[pos]] };
+            }
+        }));
+    }
+    for (auto& f : fills) {
+        f.get();
+    }
+    return result;
+}
+
+void TestSortByFrequency() {
+    {
+        const KeyWordsDictionary dictionary({ "all", "rocks", "sucks", "yangle", "zero" });
+        const vector<int> counts = { 2, 5, 2, 9, 0 };
+        const WordRun expected = { {"yangle", 9}, {"rocks", 5}, {"all", 2}, {"sucks", 2} };
+        ASSERT(SortByFrequency(dictionary, counts) == expected);
+        ASSERT(SortByFrequency(dictionary, counts, 2) == WordRun(expected.begin(), expected.begin() + 2));
+        ASSERT(SortByFrequency(dictionary, counts, 0).empty());
+    }
+    {
+        const int KEYWORDS = 300000;
+        set<string> key_words;
+        for (int i = 0; i < KEYWORDS; ++i) {
+            key_words.insert("key" + to_string(i));
+        }
+        const KeyWordsDictionary dictionary(key_words);
+        vector<int> counts(dictionary.Size());
+        mt19937 generator(42);
+        for (auto& count : counts) {
+            count = generator() % 100000;
+        }
+
+        WordRun single_threaded, parallel, top;
+        {
+            LOG_DURATION("Single-threaded frequency sort: ");
+            single_threaded = SortByFrequency(dictionary, counts, numeric_limits<size_t>::max(), 1);
+        }
+        {
+            LOG_DURATION("Parallel frequency sort: ");
+            parallel = SortByFrequency(dictionary, counts);
+        }
+        {
+            LOG_DURATION("Top 100 selection: ");
+            top = SortByFrequency(dictionary, counts, 100);
+        }
+        ASSERT(parallel == single_threaded);
+        ASSERT(top == WordRun(single_threaded.begin(), single_threaded.begin() + 100));
+        for (size_t i = 1; i < parallel.size(); ++i) {
+            ASSERT(parallel[i - 1].second >= parallel[i].second);
+        }
+    }
+}
+
+// Reassembles page buffers finished out of order. A page is written as soon as every
+// earlier page has been; pages further than capacity ahead of the next one to write
+// wait, so at most capacity buffers are held back at any time. Once the writer has
+// failed, every Submit returns at once without writing.
+class OrderedPageWriter {
+public:
+    OrderedPageWriter(ostream& output, size_t capacity)
+        : output_(output), capacity_(max<size_t>(capacity, 1)) {
+    }
+
+    void Submit(size_t sequence, string buffer) {
+        unique_lock<mutex> lock(m_);
+        has_room_.wait(lock, [this, sequence] { return failed_ || sequence < next_ + capacity_; });
+        if (failed_) return;
+        pending_.emplace(sequence, move(buffer));
+        bool advanced = false;
+        try {
+            for (auto it = pending_.begin(); it != pending_.end() && it->first == next_; it = pending_.erase(it)) {
+                output_ << it->second;
+                ++next_;
+                advanced = true;
+            }
+        } catch (...) {
+            failed_ = true;
+            has_room_.notify_all();
+            throw;
+        }
+        if (advanced) {
+            has_room_.notify_all();
+        }
+    }
+
+    // Releases the pages waiting for an earlier page that will never be submitted
+    void Fail() {
+        lock_guard<mutex> guard(m_);
+        failed_ = true;
+        has_room_.notify_all();
+    }
+private:
+    ostream& output_;
+    size_t capacity_;
+    size_t next_ = 0;
+    bool failed_ = false;
+    map<size_t, string> pending_;
+    mutex m_;
+    condition_variable has_room_;
+};
+
+// Writes the lines containing at least one keyword, in input order, like grep. Throws
+// if output fails, either from the stream itself or once the workers have finished.
+size_t WriteMatchingLines(const KeyWordsDictionary& dictionary, istream& input, ostream& output,
+    size_t worker_count = DefaultWorkerCount(), size_t page_size = 10000, size_t reorder_capacity = 0) {
+    worker_count = max<size_t>(worker_count, 1);
+    PageQueue queue(2 * worker_count);
+    OrderedPageWriter writer(output, reorder_capacity > 0 ? reorder_capacity : 2 * worker_count);
+
+    auto workers = StartPageWorkers(queue, worker_count, [&dictionary, &queue, &writer](size_t) {
+        size_t matched = 0;
+        try {
+            for (Page page; queue.Pop(page);) {
+                string buffer;
+                for (const auto& line : page.lines) {
+                    bool found = false;
+                    ForEachWord(line, [&](string_view word) {
+                        if (!found) {
+                            dictionary.ForEachMatch(word, [&found](size_t) { found = true; });
+                        }
+                    });
+                    if (found) {
+                        buffer += line;
+                        buffer += '\n';
+                        ++matched;
+                    }
+                }
+                writer.Submit(page.sequence, move(buffer));
+            }
+        } catch (...) {
+            // The pages this worker held will never reach the writer
+            writer.Fail();
+            throw;
+        }
+        return matched;
+    });
+    {
+        PageQueueCloser closer(queue);
+        FeedPages(input, queue, page_size, [] { return false; });
+    }
+
+    size_t matched = 0;
+    for (auto& f : workers) {
+        matched += f.get();
+    }
+    if (!output) {
+        throw runtime_error("failed to write matching lines");
+    }
+    return matched;
+}
+
+// Accepts the first limit characters written to it and refuses the rest
+class FailingStreamBuf : public streambuf {
+public:
+    explicit FailingStreamBuf(size_t limit)
+        : limit_(limit) {
+    }
+protected:
+    int_type overflow(int_type ch) override {
+        if (written_ == limit_) return traits_type::eof();
+        ++written_;
+        return traits_type::not_eof(ch);
+    }
+private:
+    size_t limit_;
+    size_t written_ = 0;
+};
+
+void TestMatchingLines() {
+    const KeyWordsDictionary dictionary({ "yangle", "rocks", "sucks", "all" });
+    const int LINES = 5000;
+
+    string text, expected;
+    size_t expected_matches = 0;
+    for (int i = 0; i < LINES; ++i) {
+        string line = "line " + to_string(i);
+        if (i % 3 == 0) line += " yangle";
+        if (i % 5 == 0) line += " rocks rocks";
+        text += line + "\n";
+        if (i % 3 == 0 || i % 5 == 0) {
+            expected += line + "\n";
+            ++expected_matches;
+        }
+    }
+
+    for (size_t workers : { 1, 4, 8 }) {
+        for (size_t reorder_capacity : { 1, 3, 0 }) {
+            stringstream input(text), output;
+            const size_t matched = WriteMatchingLines(dictionary, input, output, workers, 7, reorder_capacity);
+            const string hint = "workers = " + to_string(workers) + ", capacity = " + to_string(reorder_capacity);
+            AssertEqual(matched, expected_matches, hint);
+            AssertEqual(output.str(), expected, hint);
+        }
+    }
+
+    stringstream empty, output;
+    ASSERT_EQUAL(WriteMatchingLines(dictionary, empty, output), 0u);
+    ASSERT(output.str().empty());
+
+    for (bool exceptions : { true, false }) {
+        for (size_t workers : { 1, 4 }) {
+            FailingStreamBuf buffer(1000);
+            ostream failing(&buffer);
+            if (exceptions) failing.exceptions(ios::badbit);
+            stringstream input(text);
+            bool thrown = false;
+            try {
+                WriteMatchingLines(dictionary, input, failing, workers, 7, 2);
+            } catch (const exception&) {
+                thrown = true;
+            }
+            AssertEqual(thrown, true, "workers = " + to_string(workers) + ", exceptions = " + to_string(exceptions));
+        }
+    }
+
+    string long_text;
+    for (int i = 0; i < 30000; ++i) {
+        long_text += "this new yangle service really rocks\n";
+        long_text += "It sucks when yangle isn't available\n";
+        long_text += "10 reasons why the best IT company\n";
+        long_text += "others suck\n";
+        long_text += "Goondex really sucks, but yangle rocks. Use yangle\n";
+    }
+    for (size_t workers : { 1, 4 }) {
+        stringstream input(long_text), output;
+        LOG_DURATION("Matching lines, " + to_string(workers) + " workers: ");
+        ASSERT_EQUAL(WriteMatchingLines(dictionary, input, output, workers), 90000u);
+    }
+}
+
+struct ScoredLine {
+    double score = 0;
+    uint64_t offset = 0;
+    string text;
+};
+
+// Keeps the best `limit` lines seen so far in a min-heap: the root is the weakest
+// kept line, so a new line either loses to it at once or replaces it
+class TopLines {
+public:
+    explicit TopLines(size_t limit)
+        : limit_(limit) {
+    }
+
+    bool Accepts(double score, uint64_t offset) const {
+        return limit_ > 0 && (heap_.size() < limit_ || Better({ score, offset, {} }, heap_.front()));
+    }
+
+    void Add(ScoredLine line) {
+        if (!Accepts(line.score, line.offset)) return;
+        if (heap_.size() == limit_) {
+            pop_heap(heap_.begin(), heap_.end(), Better);
+            heap_.pop_back();
+        }
+        heap_.push_back(move(line));
+        push_heap(heap_.begin(), heap_.end(), Better);
+    }
+
+    void Merge(TopLines&& other) {
+        for (auto& line : other.heap_) {
+            Add(move(line));
+        }
+        other.heap_.clear();
+    }
+
+    // Best first; equal scores in input order
+    vector<ScoredLine> Sorted() && {
+        sort(heap_.begin(), heap_.end(), Better);
+        return move(heap_);
+    }
+private:
+    size_t limit_;
+    vector<ScoredLine> heap_;
+
+    static bool Better(const ScoredLine& lhs, const ScoredLine& rhs) {
+        return lhs.score != rhs.score ? lhs.score > rhs.score : lhs.offset < rhs.offset;
+    }
+};
+
+// The `top` lines with the highest sum of keyword weights over their hits (weight 1
+// for keywords not listed). Only the best lines of each page are kept and merged into
+// the worker's heap, so memory is bounded by top per worker, not by the input size.
+vector<ScoredLine> TopScoredLines(const KeyWordsDictionary& dictionary, istream& input, size_t top,
+    const map<string, double>& weights = {}, size_t worker_count = DefaultWorkerCount(), size_t page_size = 10000) {
+    vector<double> id_weights(dictionary.Size(), 1.0);
+    for (size_t id = 0; id < dictionary.Size(); ++id) {
+        if (auto it = weights.find(dictionary.Word(id)); it != weights.end()) {
+            id_weights[id] = it->second;
+        }
+    }
+
+    worker_count = max<size_t>(worker_count, 1);
+    PageQueue queue(2 * worker_count);
+    auto workers = StartPageWorkers(queue, worker_count, [&dictionary, &queue, &id_weights, top](size_t) {
+        TopLines worker_top(top);
+        for (Page page; queue.Pop(page);) {
+            TopLines page_top(top);
+            uint64_t offset = page.offset;
+            for (auto& line : page.lines) {
+                const uint64_t line_offset = offset;
+                offset += line.size() + 1;
+                double score = 0;
+                ForEachWord(line, [&](string_view word) {
+                    dictionary.ForEachMatch(word, [&](size_t id) {
+                        score += id_weights[id];
+                    });
+                });
+                if (score > 0 && page_top.Accepts(score, line_offset)) {
+                    page_top.Add({ score, line_offset, move(line) });
+                }
+            }
+            worker_top.Merge(move(page_top));
+        }
+        return worker_top;
+    });
+    {
+        PageQueueCloser closer(queue);
+        FeedPages(input, queue, page_size, [] { return false; });
+    }
+
+    TopLines result(top);
+    for (auto& f : workers) {
+        result.Merge(f.get());
+    }
+    return move(result).Sorted();
+}
+
+void TestTopScoredLines() {
+    const KeyWordsDictionary dictionary({ "yangle", "rocks", "sucks", "all" });
+    const map<string, double> weights = { {"yangle", 2.0}, {"sucks", 0.5} };
+
+    string text;
+    vector<ScoredLine> all_lines;
+    mt19937 generator(7);
+    const vector<string> words = { "yangle", "rocks", "sucks", "all", "other", "words", "here" };
+    for (int i = 0; i < 3000; ++i) {
+        string line = "line" + to_string(i);
+        double score = 0;
+        for (size_t j = generator() % 8; j > 0; --j) {
+            const string& word = words[generator() % words.size()];
+            line += " " + word;
+            if (word == "yangle") score += 2.0;
+            else if (word == "sucks") score += 0.5;
+            else if (word == "rocks" || word == "all") score += 1.0;
+        }
+        if (score > 0) {
+            all_lines.push_back({ score, text.size(), line });
+        }
+        text += line + "\n";
+    }
+    stable_sort(all_lines.begin(), all_lines.end(), [](const ScoredLine& lhs, const ScoredLine& rhs) {
+        return lhs.score > rhs.score;
+    });
+
+    for (size_t top : { 0, 1, 10, 100, 5000 }) {
+        for (size_t workers : { 1, 4 }) {
+            stringstream input(text);
+            const auto result = TopScoredLines(dictionary, input, top, weights, workers, 50);
+            const string hint = "top = " + to_string(top) + ", workers = " + to_string(workers);
+
+            AssertEqual(result.size(), min(top, all_lines.size()), hint);
+            for (size_t i = 0; i < result.size(); ++i) {
+                AssertEqual(result[i].score, all_lines[i].score, hint);
+                AssertEqual(result[i].offset, all_lines[i].offset, hint);
+                AssertEqual(result[i].text, all_lines[i].text, hint);
+                AssertEqual(text.substr(result[i].offset, result[i].text.size()), result[i].text, hint);
+            }
+        }
+    }
+}
+
 template<typename T>
 class Synchronized {
 public:
@@ -346,6 +5124,32 @@ int main()
         LOG_DURATION("long test");
         RUN_TEST(tr, TestLong);
     }
+    RUN_TEST(tr, TestMultiQuery);
+    RUN_TEST(tr, TestPatterns);
+    RUN_TEST(tr, TestPatternDfaMinimized);
+    RUN_TEST(tr, TestHotSwapKeyWords);
+    RUN_TEST(tr, TestLineCache);
+    RUN_TEST(tr, TestThresholdQueries);
+    RUN_TEST(tr, TestCancellation);
+    RUN_TEST(tr, TestProgressReports);
+    RUN_TEST(tr, TestStatsSerialization);
+    RUN_TEST(tr, TestProcessShards);
+    RUN_TEST(tr, TestCooccurrence);
+    RUN_TEST(tr, TestNgrams);
+    RUN_TEST(tr, TestSampledScan);
+    RUN_TEST(tr, TestBloomPrefilter);
+    RUN_TEST(tr, TestCompactDictionary);
+    RUN_TEST(tr, TestPrefixCounts);
+    RUN_TEST(tr, TestFuzzyKeyWords);
+    RUN_TEST(tr, TestStaticKeyWords);
+    RUN_TEST(tr, TestPackedKeyWords);
+    RUN_TEST(tr, TestPerWorkerAccumulation);
+    RUN_TEST(tr, TestSharedCounters);
+    RUN_TEST(tr, TestShardedCounters);
+    RUN_TEST(tr, TestSpillingWordCounts);
+    RUN_TEST(tr, TestSortByFrequency);
+    RUN_TEST(tr, TestMatchingLines);
+    RUN_TEST(tr, TestTopScoredLines);
 
     RUN_TEST(tr, TestConcurrentUpdate);
     RUN_TEST(tr, TestProducerConsumer);